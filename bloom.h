@@ -0,0 +1,72 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Number of bits set per key, derived from one 32 bit hash by double hashing
+#define BLOOM_HASHES 4
+// Bits per key, with 4 hashes this gives well under 1% false positives
+#define BLOOM_BITS_PER_KEY 16
+
+// Bloom filter over 32 bit name hashes. A miss means the key was never added,
+// a hit means it probably was.
+typedef struct {
+  uint64_t *bits;
+  // Number of bits minus one, the number of bits is a power of two
+  size_t mask;
+} bloom_t;
+
+int bloom_init(bloom_t *bloom, size_t keys);
+
+void bloom_add(bloom_t *bloom, uint32_t hash);
+
+bool bloom_check(const bloom_t *bloom, uint32_t hash);
+
+void bloom_free(bloom_t *bloom);
+
+int bloom_init(bloom_t *bloom, size_t keys) {
+  size_t bits = 512;
+  while (bits < keys * BLOOM_BITS_PER_KEY)
+    bits <<= 1;
+  bloom->bits = calloc(bits / 64, sizeof(uint64_t));
+  if (!bloom->bits)
+    return -1;
+  bloom->mask = bits - 1;
+  return 0;
+}
+
+// Second hash for double hashing, odd so every bit can be reached
+static uint32_t bloom_step(uint32_t hash) {
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13;
+  return hash | 1;
+}
+
+void bloom_add(bloom_t *bloom, uint32_t hash) {
+  uint32_t step = bloom_step(hash);
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    size_t bit = hash & bloom->mask;
+    bloom->bits[bit >> 6] |= (uint64_t)1 << (bit & 63);
+    hash += step;
+  }
+}
+
+bool bloom_check(const bloom_t *bloom, uint32_t hash) {
+  if (!bloom->bits)
+    return false;
+  uint32_t step = bloom_step(hash);
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    size_t bit = hash & bloom->mask;
+    if (!(bloom->bits[bit >> 6] & ((uint64_t)1 << (bit & 63))))
+      return false;
+    hash += step;
+  }
+  return true;
+}
+
+void bloom_free(bloom_t *bloom) {
+  free(bloom->bits);
+  bloom->bits = NULL;
+  bloom->mask = 0;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include "mdns.h"
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Truncated queries waiting for the rest of their known answers at once,
+// further ones are answered right away
+#define HELD_QUERIES 16
+// Known answers remembered per held query, beyond this they are ignored
+#define HELD_QUERY_KNOWN 256
+
+// A query with the truncated bit set, held until the packets carrying the
+// rest of its known-answer list from the same sender have arrived. The known
+// answers in those packets are kept as the records they refer to.
+typedef struct {
+  // Sender, a port of 0 marks a free entry
+  struct sockaddr_in from;
+  char *query;
+  size_t size;
+  const mdns_record_t *known[HELD_QUERY_KNOWN];
+  size_t known_count;
+  // Loop time in milliseconds at which the query is answered
+  uint64_t expires;
+} held_query_t;
+
+typedef struct {
+  held_query_t queries[HELD_QUERIES];
+  size_t count;
+} held_queries_t;
+
+held_query_t *held_queries_find(held_queries_t *held,
+                                const struct sockaddr_in *from);
+
+held_query_t *held_queries_add(held_queries_t *held,
+                               const struct sockaddr_in *from,
+                               const void *query, size_t size,
+                               uint64_t expires);
+
+void held_query_known(held_query_t *query, const mdns_record_t *record);
+
+held_query_t *held_queries_next(held_queries_t *held);
+
+void held_queries_remove(held_queries_t *held, held_query_t *query);
+
+void held_queries_clear(held_queries_t *held);
+
+held_query_t *held_queries_find(held_queries_t *held,
+                                const struct sockaddr_in *from) {
+  for (int i = 0; i < HELD_QUERIES && held->count; i++) {
+    held_query_t *query = &held->queries[i];
+    if (query->from.sin_port && (query->from.sin_port == from->sin_port) &&
+        (query->from.sin_addr.s_addr == from->sin_addr.s_addr))
+      return query;
+  }
+  return NULL;
+}
+
+// Hold a copy of a query, returns NULL if every entry is taken
+held_query_t *held_queries_add(held_queries_t *held,
+                               const struct sockaddr_in *from,
+                               const void *query, size_t size,
+                               uint64_t expires) {
+  for (int i = 0; i < HELD_QUERIES; i++) {
+    held_query_t *entry = &held->queries[i];
+    if (entry->from.sin_port)
+      continue;
+    entry->query = malloc(size);
+    if (!entry->query)
+      return NULL;
+    memcpy(entry->query, query, size);
+    entry->size = size;
+    entry->from = *from;
+    entry->known_count = 0;
+    entry->expires = expires;
+    held->count++;
+    return entry;
+  }
+  return NULL;
+}
+
+void held_query_known(held_query_t *query, const mdns_record_t *record) {
+  if (query->known_count < HELD_QUERY_KNOWN)
+    query->known[query->known_count++] = record;
+}
+
+// The held query to be answered first, or NULL if none is held
+held_query_t *held_queries_next(held_queries_t *held) {
+  held_query_t *next = NULL;
+  for (int i = 0; i < HELD_QUERIES && held->count; i++) {
+    held_query_t *query = &held->queries[i];
+    if (query->from.sin_port && (!next || (query->expires < next->expires)))
+      next = query;
+  }
+  return next;
+}
+
+void held_queries_remove(held_queries_t *held, held_query_t *query) {
+  free(query->query);
+  query->query = NULL;
+  query->from.sin_port = 0;
+  held->count--;
+}
+
+void held_queries_clear(held_queries_t *held) {
+  for (int i = 0; i < HELD_QUERIES; i++) {
+    if (held->queries[i].from.sin_port)
+      held_queries_remove(held, &held->queries[i]);
+  }
+}
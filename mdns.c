@@ -1,8 +1,17 @@
 #include "mdns.h"
 #include "service.h"
+#include "held_queries.h"
+#include "packet_cache.h"
+#include "rate_limit.h"
+#include "recv_pool.h"
+#include "response_builder.h"
+#include "response_cache.h"
+#include "response_scheduler.h"
+#include "service_index.h"
 
 #include <argp.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <netdb.h>
@@ -19,22 +28,111 @@
     exit(1);                                                                   \
   }
 
+// Questions beyond this in a single packet are ignored
+#define MAX_QUESTIONS 32
+// Known answers beyond this in a single packet are ignored
+#define MAX_KNOWN_ANSWERS 64
+// Datagrams read per recvmmsg call, libuv reads at most 20, each into a
+// chunk of the receive buffer as large as the largest UDP datagram
+#define RECV_BATCH 16
+#define RECV_DATAGRAM_SIZE (64 * 1024)
+// Largest mDNS packet, larger datagrams are dropped (RFC 6762 section 17)
+#define RECV_PACKET_MAX 9000
+// Receive buffers pooled, libuv hands each back before asking for the next
+#define RECV_POOL_BUFFERS 2
+// Send requests pooled, and how many must be free to keep reading queries
+#define SEND_POOL_REQUESTS 256
+#define SEND_POOL_RESERVE 32
+
+// How a received packet is handled, decided from its header alone
+typedef enum {
+  PACKET_QUERY = 0,
+  // Answers from other responders, and our own multicasts looped back
+  PACKET_RESPONSE,
+  // Opcodes other than a standard query, which mDNS does not use
+  PACKET_UNSUPPORTED,
+  // Shorter than a header
+  PACKET_MALFORMED,
+  PACKET_CLASS_COUNT
+} packet_class_t;
+
+static const char *packet_class_names[PACKET_CLASS_COUNT] = {
+    "query", "response", "unsupported", "malformed"};
+
 static uv_loop_t *uv_loop;
 static uv_udp_t *server = NULL;
 static uv_timer_t *announce_timer = NULL;
 static uv_timer_t *goodbye_timer = NULL;
+static uv_timer_t *held_timer = NULL;
+static uv_timer_t *response_timer = NULL;
+static uv_check_t *send_check = NULL;
+static uv_prepare_t *send_prepare = NULL;
+// Reading stopped until queued sends complete and free their requests
+static bool recv_paused = false;
 
 static char addrbuffer[64];
-static char namebuffer[256];
-static char sendbuffer[1024];
-
-typedef struct {
-  service_t *service;
-  uv_udp_t *handle;
-} mdns_data_t;
+static char fromaddrbuffer[64];
+// Largest payload we send, 1440 fits a 1500 byte Ethernet MTU after IPv4 or
+// IPv6 and UDP headers. RFC 6762 allows up to 9000 byte packets on networks
+// with jumbo frames, less the 48 bytes of IPv6 and UDP headers.
+#define PAYLOAD_SIZE_DEFAULT 1440
+#define PAYLOAD_SIZE_MIN 512
+#define PAYLOAD_SIZE_MAX 8952
+// Longest response delay accepted, beyond this queriers give up waiting
+#define RESPONSE_DELAY_LIMIT 1000
+static char *sendbuffer = NULL;
+static size_t sendbuffer_size = PAYLOAD_SIZE_DEFAULT;
 
 static service_t *services = NULL;
 static int services_count = 0;
+static service_index_t service_index = {0};
+static mdns_label_table_t label_table;
+static response_cache_t response_cache = {0};
+static packet_cache_t packet_cache = {0};
+static held_queries_t held_queries = {0};
+static response_scheduler_t response_scheduler = {0};
+static rate_limit_t rate_limit = {0};
+static recv_pool_t recv_pool = {0};
+
+// Answers to the packet being handled, one set per delivery mode. When the
+// only answer is for one of a service's own names it comes from the response
+// cache instead, echoing the question it answers.
+typedef struct {
+  response_builder_t builder;
+  const service_t *service;
+  service_name_kind_t kind;
+  const mdns_question_t *question;
+} packet_answer_t;
+
+// Multicast answers first, then unicast
+static packet_answer_t packet_answers[2];
+
+// Counters printed on SIGUSR1 and at exit
+static struct {
+  uint64_t packets[PACKET_CLASS_COUNT];
+  // Queries where every question missed the name filter
+  uint64_t packets_filtered;
+  // Questions checked against the name filter, the ones passing it, and the
+  // ones passing it that turned out not to be ours
+  uint64_t filter_checks;
+  uint64_t filter_hits;
+  uint64_t filter_false_positives;
+  // Known answers in queries that are records of ours, records left out of
+  // answers because of them, and truncated queries held for more of them
+  uint64_t known_answers;
+  uint64_t answers_suppressed;
+  uint64_t queries_held;
+  // Cached answers not replayed as records in them were multicast recently
+  uint64_t replays_limited;
+  // Datagrams received, and the reads they took, several per read with
+  // recvmmsg
+  uint64_t datagrams;
+  uint64_t reads;
+  // Datagrams dropped for being larger than any mDNS packet
+  uint64_t datagrams_oversized;
+  // Times reading stopped for lack of free send requests
+  uint64_t recv_paused;
+} stats = {0};
 
 static mdns_string_t ipv4_address_to_string(char *buffer, size_t capacity,
                                             const struct sockaddr_in *addr,
@@ -68,198 +166,161 @@ static mdns_string_t ip_address_to_string(char *buffer, size_t capacity,
                                 (const struct sockaddr_in *)addr, addrlen);
 }
 
-// Callback handling questions incoming on service sockets
-static int service_callback(int sock, const struct sockaddr *from,
-                            size_t addrlen, mdns_entry_type_t entry,
-                            uint16_t query_id, uint16_t rtype, uint16_t rclass,
-                            uint32_t ttl, const void *data, size_t size,
-                            size_t name_offset, size_t name_length,
-                            size_t record_offset, size_t record_length,
-                            void *user_data) {
-  (void)sizeof(ttl);
-  if (entry != MDNS_ENTRYTYPE_QUESTION) {
-    return 0;
-  }
-
-  const char dns_sd[] = "_services._dns-sd._udp.local.";
-  const mdns_data_t *mdns_data = (const mdns_data_t *)user_data;
-  const service_t *service = (const service_t *)mdns_data->service;
-  uv_udp_t *handle = mdns_data->handle;
-
-  mdns_string_t fromaddrstr =
-      ip_address_to_string(addrbuffer, sizeof(addrbuffer), from, addrlen);
-
-  size_t offset = name_offset;
-  mdns_string_t name =
-      mdns_string_extract(data, size, &offset, namebuffer, sizeof(namebuffer));
-
-  const char *record_name = 0;
+static const char *record_type_name(uint16_t rtype) {
   if (rtype == MDNS_RECORDTYPE_PTR)
-    record_name = "PTR";
+    return "PTR";
   else if (rtype == MDNS_RECORDTYPE_SRV)
-    record_name = "SRV";
+    return "SRV";
   else if (rtype == MDNS_RECORDTYPE_A)
-    record_name = "A";
+    return "A";
   else if (rtype == MDNS_RECORDTYPE_AAAA)
-    record_name = "AAAA";
+    return "AAAA";
   else if (rtype == MDNS_RECORDTYPE_TXT)
-    record_name = "TXT";
+    return "TXT";
+  else if (rtype == MDNS_RECORDTYPE_NSEC)
+    return "NSEC";
   else if (rtype == MDNS_RECORDTYPE_ANY)
-    record_name = "ANY";
-  else {
-    printf("\nQuery BAD RTYPE '%d', %s %.*s from %.*s\n", rtype, record_name,
-           MDNS_STRING_FORMAT(name), MDNS_STRING_FORMAT(fromaddrstr));
-    return 0;
+    return "ANY";
+  return 0;
+}
+
+// Encode the answer for one of the service's names collected in the builder
+// into sendbuffer, returning its size or 0 if it does not fit
+static size_t service_answer_encode(const struct sockaddr *from,
+                                    size_t addrlen,
+                                    const response_builder_t *builder,
+                                    bool unicast) {
+  // Without a handle the packet builder only writes the packet
+  mdns_packet_builder_t packet;
+  mdns_packet_builder_init(&packet, NULL, unicast ? from : NULL, addrlen,
+                           sendbuffer, sendbuffer_size, 0, builder->questions,
+                           builder->questions_count);
+  for (size_t i = 0; i < builder->answers_count; i++) {
+    if (mdns_packet_builder_add(&packet, builder->answers[i],
+                                MDNS_ENTRYTYPE_ANSWER) < 0)
+      return 0;
   }
-  printf("\nQuery %s %.*s from %.*s\n", record_name, MDNS_STRING_FORMAT(name),
-         MDNS_STRING_FORMAT(fromaddrstr));
-
-  bool is_sd_domain_query =
-      (name.length == (sizeof(dns_sd) - 1)) &&
-      (strncmp(name.str, dns_sd, sizeof(dns_sd) - 1) == 0);
-  bool is_service_query =
-      (name.length == service->service.length) &&
-      (strncmp(name.str, service->service.str, name.length) == 0);
-  bool is_service_instance_query =
-      (name.length == service->service_instance.length) &&
-      (strncmp(name.str, service->service_instance.str, name.length) == 0);
-  bool is_qualified_hostname_query =
-      (name.length == service->hostname_qualified.length) &&
-      (strncmp(name.str, service->hostname_qualified.str, name.length) == 0);
-
-  if (is_sd_domain_query) {
-    if ((rtype == MDNS_RECORDTYPE_PTR) || (rtype == MDNS_RECORDTYPE_ANY)) {
-      // The PTR query was for the DNS-SD domain, send answer with a PTR record
-      // for the service name we advertise, typically on the
-      // "<_service-name>._tcp.local." format
-
-      // Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-      // "<hostname>.<_service-name>._tcp.local."
-      mdns_record_t answer = {.name = name,
-                              .type = MDNS_RECORDTYPE_PTR,
-                              .data.ptr.name = service->service};
-
-      // Send the answer, unicast or multicast depending on flag in query
-      uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-      printf("  --> answer %.*s (%s)\n",
-             MDNS_STRING_FORMAT(answer.data.ptr.name),
-             (unicast ? "unicast" : "multicast"));
+  for (size_t i = 0; i < builder->additional_count; i++) {
+    if (mdns_packet_builder_add(&packet, builder->additional[i],
+                                MDNS_ENTRYTYPE_ADDITIONAL) < 0)
+      return 0;
+  }
+  return mdns_packet_builder_close(&packet);
+}
 
-      if (unicast) {
-        mdns_query_answer_unicast(handle, from, addrlen, sendbuffer,
-                                  sizeof(sendbuffer), query_id, rtype, name.str,
-                                  name.length, answer, 0, 0, 0, 0);
-      } else {
-        mdns_query_answer_multicast(handle, sendbuffer, sizeof(sendbuffer),
-                                    answer, 0, 0, 0, 0);
-      }
+// Send the answer for one of the service's names, unicast or multicast
+// depending on flag in query. The record set of a service never changes, so
+// the encoded answer is cached. Only a unicast answer differs between sends,
+// in the query ID and the question it echoes from the query. Multicast
+// answers carry ID 0 (RFC 6762 section 18.1).
+static void service_answer_send(uv_udp_t *handle, const struct sockaddr *from,
+                                size_t addrlen, uint16_t query_id,
+                                const void *query,
+                                const mdns_question_t *question,
+                                const response_builder_t *builder,
+                                const service_t *service,
+                                service_name_kind_t kind, bool unicast) {
+  uint16_t rtype = question->rtype;
+  size_t position = (size_t)(service - services);
+  unsigned int variant = (rtype == MDNS_RECORDTYPE_ANY)   ? 2
+                         : (rtype == MDNS_RECORDTYPE_TXT) ? 1
+                                                          : 0;
+  size_t slot =
+      response_cache_slot(kind == SERVICE_NAME_INSTANCE, variant, unicast);
+  const response_t *response =
+      response_cache_get(&response_cache, position, slot);
+  if (!response) {
+    size_t size = service_answer_encode(from, addrlen, builder, unicast);
+    if (!size) {
+      fprintf(stderr, "Unable to encode answer\n");
+      return;
     }
-  } else if (is_service_query) {
-    if ((rtype == MDNS_RECORDTYPE_PTR) || (rtype == MDNS_RECORDTYPE_ANY)) {
-      // The PTR query was for our service (usually
-      // "<_service-name._tcp.local"), answer a PTR record reverse mapping the
-      // queried service name to our service instance name (typically on the
-      // "<hostname>.<_service-name>._tcp.local." format), and add additional
-      // records containing the SRV record mapping the service instance name to
-      // our qualified hostname (typically "<hostname>.local.") and port, as
-      // well as any IPv4 address for the hostname as A records, and
-      // TXT records
-
-      // Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-      // "<hostname>.<_service-name>._tcp.local."
-      mdns_record_t answer = service->record_ptr;
-
-      mdns_record_t additional[5] = {0};
-      size_t additional_count = 0;
-
-      // SRV record mapping "<hostname>.<_service-name>._tcp.local." to
-      // "<hostname>.local." with port. Set weight & priority to 0.
-      additional[additional_count++] = service->record_srv;
-
-      // A records mapping "<hostname>.local." to IPv4 addresses
-      if (service->address_ipv4.sin_family == AF_INET)
-        additional[additional_count++] = service->record_a;
-
-      // Add TXT records for our service instance name, will be
-      // coalesced into one record with both key-value pair strings by the
-      // library
-      additional[additional_count++] = service->txt_record[0];
-
-      // Send the answer, unicast or multicast depending on flag in query
-      uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-      printf("  --> answer %.*s (%s)\n",
-             MDNS_STRING_FORMAT(service->record_ptr.data.ptr.name),
-             (unicast ? "unicast" : "multicast"));
-
-      if (unicast) {
-        mdns_query_answer_unicast(handle, from, addrlen, sendbuffer,
-                                  sizeof(sendbuffer), query_id, rtype, name.str,
-                                  name.length, answer, 0, 0, additional,
-                                  additional_count);
-      } else {
-        mdns_query_answer_multicast(handle, sendbuffer, sizeof(sendbuffer),
-                                    answer, 0, 0, additional, additional_count);
-      }
+    response = response_cache_put(&response_cache, position, slot,
+                                  sendbuffer, size);
+    if (!response) {
+      mdns_answer_send(handle, unicast ? from : NULL, addrlen, sendbuffer,
+                       size, unicast ? query_id : 0);
+      return;
     }
-  } else if (is_service_instance_query) {
-    if ((rtype == MDNS_RECORDTYPE_SRV) || (rtype == MDNS_RECORDTYPE_ANY)) {
-      // The SRV query was for our service instance (usually
-      // "<hostname>.<_service-name._tcp.local"), answer a SRV record mapping
-      // the service instance name to our qualified hostname (typically
-      // "<hostname>.local.") and port, as well as any IPv4 address for the
-      // hostname as A records, and TXT records
-
-      // Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-      // "<hostname>.<_service-name>._tcp.local."
-      mdns_record_t answer = service->record_srv;
-
-      mdns_record_t additional[5] = {0};
-      size_t additional_count = 0;
+  }
+  if (unicast)
+    mdns_answer_send_question(
+        handle, from, addrlen, response->data, response->size, query_id,
+        MDNS_POINTER_OFFSET_CONST(query, question->name_offset),
+        question->name_length + 4);
+  else
+    mdns_answer_send(handle, NULL, addrlen, response->data, response->size,
+                     0);
+}
 
-      // A records mapping "<hostname>.local." to IPv4 addresses
-      if (service->address_ipv4.sin_family == AF_INET)
-        additional[additional_count++] = service->record_a;
+// Answers collected from every question in the packet being handled
+static packet_answer_t *packet_answer_for(const mdns_question_t *question) {
+  bool unicast = (question->rclass & MDNS_UNICAST_RESPONSE);
+  return &packet_answers[unicast ? 1 : 0];
+}
 
-      // Add TXT records for our service instance name, will be
-      // coalesced into one record with both key-value pair strings by the
-      // library
-      additional[additional_count++] = service->txt_record[0];
+// Tell the querier a name has none of the records asked for, with the NSEC
+// record listing the types it does have (RFC 6762 section 6.1)
+static void service_negative_answer(const mdns_question_t *question,
+                                    const mdns_record_t *nsec) {
+  uint16_t unicast = (question->rclass & MDNS_UNICAST_RESPONSE);
+  const char *record_name = record_type_name(question->rtype);
+  printf("  --> answer %.*s has no %s%.0d records (%s)\n",
+         MDNS_STRING_FORMAT(nsec->name), record_name ? record_name : "type ",
+         record_name ? 0 : question->rtype,
+         (unicast ? "unicast" : "multicast"));
+
+  response_builder_t *builder = &packet_answer_for(question)->builder;
+  response_builder_question(builder, question->rtype, nsec->name);
+  response_builder_answer(builder, nsec);
+}
 
-      // Send the answer, unicast or multicast depending on flag in query
+// Answer a single decoded question on behalf of one service, given which of
+// the service's names the question matched. Positive answers carry the NSEC
+// records of the names involved as additional records, so the querier knows
+// there are no other types to ask for.
+static void service_answer(const mdns_question_t *question,
+                           const service_t *service, service_name_kind_t kind) {
+  uint16_t rtype = question->rtype;
+  uint16_t rclass = question->rclass;
+  packet_answer_t *answer = packet_answer_for(question);
+  response_builder_t *builder = &answer->builder;
+
+  bool is_service_instance_query = (kind == SERVICE_NAME_INSTANCE);
+  bool is_qualified_hostname_query = (kind == SERVICE_NAME_HOSTNAME);
+
+  if (is_service_instance_query) {
+    if ((rtype == MDNS_RECORDTYPE_SRV) || (rtype == MDNS_RECORDTYPE_ANY)) {
       uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
       printf("  --> answer %.*s port %d (%s)\n",
              MDNS_STRING_FORMAT(service->record_srv.data.srv.name),
              service->port, (unicast ? "unicast" : "multicast"));
 
-      if (unicast) {
-        mdns_query_answer_unicast(handle, from, addrlen, sendbuffer,
-                                  sizeof(sendbuffer), query_id, rtype, name.str,
-                                  name.length, answer, 0, 0, additional,
-                                  additional_count);
-      } else {
-        mdns_query_answer_multicast(handle, sendbuffer, sizeof(sendbuffer),
-                                    answer, 0, 0, additional, additional_count);
-      }
+      response_builder_question(builder, rtype, service->service_instance);
+      response_builder_answer(builder, &service->record_srv);
+      if (rtype == MDNS_RECORDTYPE_ANY)
+        response_builder_answer(builder, &service->txt_record[0]);
+      if (service->address_ipv4.sin_family == AF_INET)
+        response_builder_additional(builder, &service->record_a);
+      response_builder_additional(builder, &service->txt_record[0]);
+      response_builder_additional(builder, &service->record_nsec_instance);
+      response_builder_additional(builder, &service->record_nsec_hostname);
+    } else if (rtype == MDNS_RECORDTYPE_TXT) {
+      uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
+      printf("  --> answer %.*s TXT (%s)\n",
+             MDNS_STRING_FORMAT(service->service_instance),
+             (unicast ? "unicast" : "multicast"));
+
+      response_builder_question(builder, rtype, service->service_instance);
+      response_builder_answer(builder, &service->txt_record[0]);
+      response_builder_additional(builder, &service->record_nsec_instance);
+    } else {
+      service_negative_answer(question, &service->record_nsec_instance);
+      return;
     }
   } else if (is_qualified_hostname_query) {
     if (((rtype == MDNS_RECORDTYPE_A) || (rtype == MDNS_RECORDTYPE_ANY)) &&
         (service->address_ipv4.sin_family == AF_INET)) {
-      // The A query was for our qualified hostname (typically
-      // "<hostname>.local.") and we have an IPv4 address, answer with an A
-      // record mapping the hostname to an IPv4 address and TXT records
-
-      // Answer A records mapping "<hostname>.local." to IPv4 address
-      mdns_record_t answer = service->record_a;
-
-      mdns_record_t additional[5] = {0};
-      size_t additional_count = 0;
-
-      // Add TXT records for our service instance name, will be
-      // coalesced into one record with both key-value pair strings by the
-      // library
-      additional[additional_count++] = service->txt_record[0];
-
-      // Send the answer, unicast or multicast depending on flag in query
       uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
       mdns_string_t addrstr = ip_address_to_string(
           addrbuffer, sizeof(addrbuffer),
@@ -269,38 +330,609 @@ static int service_callback(int sock, const struct sockaddr *from,
              MDNS_STRING_FORMAT(service->record_a.name),
              MDNS_STRING_FORMAT(addrstr), (unicast ? "unicast" : "multicast"));
 
-      if (unicast) {
-        mdns_query_answer_unicast(handle, from, addrlen, sendbuffer,
-                                  sizeof(sendbuffer), query_id, rtype, name.str,
-                                  name.length, answer, 0, 0, additional,
-                                  additional_count);
-      } else {
-        mdns_query_answer_multicast(handle, sendbuffer, sizeof(sendbuffer),
-                                    answer, 0, 0, additional, additional_count);
-      }
+      response_builder_question(builder, rtype, service->hostname_qualified);
+      response_builder_answer(builder, &service->record_a);
+      response_builder_additional(builder, &service->txt_record[0]);
+      response_builder_additional(builder, &service->record_nsec_hostname);
+    } else {
+      // Typically AAAA, as we have no IPv6 addresses
+      service_negative_answer(question, &service->record_nsec_hostname);
+      return;
     }
   } else {
+    return;
+  }
+  // Only positive answers are cached, negative ones depend on the type asked
+  // for
+  answer->service = service;
+  answer->kind = kind;
+  answer->question = question;
+}
+
+// Answer a browse for one of our service types. Every instance of the type
+// is listed as a PTR record reverse mapping the service type (usually
+// "<_service-name>._tcp.local.") to the instance name (typically
+// "<hostname>.<_service-name>._tcp.local."). The SRV, A and TXT records of
+// each instance are added as additional records where they fit, unless the
+// querier already knows the instance.
+static void service_type_answer(const mdns_question_t *question,
+                                const service_type_t *type) {
+  uint16_t rtype = question->rtype;
+  if ((rtype != MDNS_RECORDTYPE_PTR) && (rtype != MDNS_RECORDTYPE_ANY))
+    return;
+
+  uint16_t unicast = (question->rclass & MDNS_UNICAST_RESPONSE);
+  printf("  --> answer %zu instances of %.*s (%s)\n", type->answer_count,
+         MDNS_STRING_FORMAT(type->name), (unicast ? "unicast" : "multicast"));
+
+  response_builder_t *builder = &packet_answer_for(question)->builder;
+  response_builder_question(builder, rtype, type->name);
+  for (size_t i = 0; i < type->answer_count; i++) {
+    if (response_builder_answer(builder, type->answers[i]))
+      continue;
+    for (size_t j = type->additional_start[i];
+         j < type->additional_start[i + 1]; j++)
+      response_builder_additional(builder, type->additional[j]);
+  }
+}
+
+// Answer a DNS-SD service type enumeration with a PTR record per distinct
+// service type we advertise, typically on the "<_service-name>._tcp.local."
+// format, however many services share each type
+static void dns_sd_answer(const mdns_question_t *question) {
+  uint16_t rtype = question->rtype;
+  if ((rtype != MDNS_RECORDTYPE_PTR) && (rtype != MDNS_RECORDTYPE_ANY))
+    return;
+
+  uint16_t unicast = (question->rclass & MDNS_UNICAST_RESPONSE);
+  printf("  --> answer %zu service types (%s)\n", service_index.types_count,
+         (unicast ? "unicast" : "multicast"));
+
+  mdns_string_t name = {MDNS_STRING_CONST(SERVICE_DNS_SD_NAME)};
+  response_builder_t *builder = &packet_answer_for(question)->builder;
+  response_builder_question(builder, rtype, name);
+  for (size_t i = 0; i < service_index.types_count; i++)
+    response_builder_answer(builder, service_index.dns_sd_answers[i]);
+}
+
+static void packet_answers_reset(void) {
+  for (int i = 0; i < 2; i++) {
+    response_builder_reset(&packet_answers[i].builder);
+    packet_answers[i].service = NULL;
+  }
+}
+
+static void on_response_timer(uv_timer_t *timer);
+
+// Hold back the shared answers of a multicast response, to go out with any
+// other answers due in the same window. PTR records are the shared ones,
+// other responders may hold the same, every other record we answer with is
+// unique to us and stays in the builder to be sent now, along with the
+// additional records. Returns false if nothing was held back.
+static bool packet_answers_schedule(response_builder_t *builder) {
+  if (!response_scheduler.delay_max)
+    return false;
+  // Unique answers first, keeping their order, shared ones after them
+  size_t unique_count = 0;
+  for (size_t i = 0; i < builder->answers_count; i++) {
+    const mdns_record_t *record = builder->answers[i];
+    if (record->type == MDNS_RECORDTYPE_PTR)
+      continue;
+    builder->answers[i] = builder->answers[unique_count];
+    builder->answers[unique_count++] = record;
+  }
+  if (unique_count == builder->answers_count)
+    return false;
+
+  response_builder_t shared = *builder;
+  shared.answers += unique_count;
+  shared.answers_count -= unique_count;
+  // Additional records go out with the unique answers, or with the shared
+  // ones when there are no unique answers to send now
+  if (unique_count)
+    shared.additional_count = 0;
+  uint64_t now = uv_now(uv_loop);
+  uint64_t due = response_scheduler_add(&response_scheduler, &shared, now);
+  if (!due)
+    return false;
+  // Sent from the timer, not while the query is being answered, and a replay
+  // of what is sent now would miss them
+  packet_cache_cancel(&packet_cache);
+  uv_timer_start(response_timer, on_response_timer, due - now, 0);
+  builder->answers_count = unique_count;
+  if (!unique_count)
+    builder->additional_count = 0;
+  return true;
+}
+
+// Leave out the records multicast too recently, less than a second ago or a
+// quarter of a second when defending them against a probe (RFC 6762 section
+// 6). Returns the number of records left out.
+static size_t packet_answers_limit(response_builder_t *builder, bool probe) {
+  uint64_t now = uv_now(uv_loop);
+  uint64_t interval = probe ? RATE_LIMIT_INTERVAL_PROBE : RATE_LIMIT_INTERVAL;
+  size_t answers_count = 0;
+  for (size_t i = 0; i < builder->answers_count; i++) {
+    const mdns_record_t *record = builder->answers[i];
+    if (rate_limit_allow(&rate_limit, record->slot, now, interval))
+      builder->answers[answers_count++] = record;
+  }
+  size_t additional_count = 0;
+  for (size_t i = 0; i < builder->additional_count; i++) {
+    const mdns_record_t *record = builder->additional[i];
+    if (rate_limit_allow(&rate_limit, record->slot, now, interval))
+      builder->additional[additional_count++] = record;
+  }
+  size_t limited = (builder->answers_count - answers_count) +
+                   (builder->additional_count - additional_count);
+  builder->answers_count = answers_count;
+  builder->additional_count = additional_count;
+  return limited;
+}
+
+// Send the multicast answers that were held back
+static void on_response_timer(uv_timer_t *timer) {
+  response_builder_t *pending = &response_scheduler.pending;
+  if (!response_scheduler_due(&response_scheduler, uv_now(uv_loop)))
+    return;
+  response_builder_finish(pending);
+  packet_answers_limit(pending, false);
+  if (!pending->answers_count) {
+    response_scheduler_reset(&response_scheduler);
+    return;
+  }
+  int ret = mdns_answer_records(
+      server, NULL, 0, sendbuffer, sendbuffer_size, 0, NULL, 0,
+      pending->answers, pending->answers_count, pending->additional,
+      pending->additional_count);
+  if (ret < 0)
+    fprintf(stderr, "Unable to send %zu delayed answers\n",
+            pending->answers_count);
+  response_scheduler_reset(&response_scheduler);
+}
+
+// Send everything collected for the packet, unicast or multicast depending on
+// flag in query, in as few packets as the records fit in. Shared multicast
+// answers are delayed instead, and records multicast recently are left out.
+static void packet_answers_send(uv_udp_t *handle, const struct sockaddr *from,
+                                size_t addrlen, uint16_t query_id,
+                                const void *query, bool probe) {
+  for (int unicast = 0; unicast < 2; unicast++) {
+    packet_answer_t *answer = &packet_answers[unicast];
+    response_builder_t *builder = &answer->builder;
+    if (!builder->sources)
+      continue;
+    stats.answers_suppressed += builder->suppressed;
+    // Nothing left to tell when the querier holds every answer
+    if (!builder->answers_count)
+      continue;
+    response_builder_finish(builder);
+    size_t limited = 0;
+    if (!unicast) {
+      if (packet_answers_schedule(builder) && !builder->answers_count)
+        continue;
+      limited = packet_answers_limit(builder, probe);
+      // A repeat of the query is replayed only if every record multicast
+      // may be multicast again by then. Answers missing records are not
+      // replayed at all.
+      if (limited)
+        packet_cache_cancel(&packet_cache);
+      for (size_t i = 0; i < builder->answers_count; i++)
+        packet_cache_record_slot(&packet_cache, builder->answers[i]->slot);
+      for (size_t i = 0; i < builder->additional_count; i++)
+        packet_cache_record_slot(&packet_cache, builder->additional[i]->slot);
+      if (!builder->answers_count)
+        continue;
+    }
+    // A lone answer for one of a service's names is already encoded, unless
+    // some of its records are left out
+    if ((builder->sources == 1) && answer->service && !builder->suppressed &&
+        !limited) {
+      service_answer_send(handle, from, addrlen, query_id, query,
+                          answer->question, builder, answer->service,
+                          answer->kind, unicast);
+      continue;
+    }
+    int ret = mdns_answer_records(
+        handle, unicast ? from : NULL, addrlen, sendbuffer, sendbuffer_size,
+        query_id, builder->questions, builder->questions_count,
+        builder->answers, builder->answers_count, builder->additional,
+        builder->additional_count);
+    if (ret < 0)
+      fprintf(stderr, "Unable to send %zu answers (%s)\n",
+              builder->answers_count, (unicast ? "unicast" : "multicast"));
+  }
+}
+
+static packet_class_t packet_classify(const void *buffer, size_t size,
+                                      struct mdns_header_t *header) {
+  if (!uvmdns_header_parse(buffer, size, header))
+    return PACKET_MALFORMED;
+  if (header->flags & MDNS_FLAGS_RESPONSE)
+    return PACKET_RESPONSE;
+  if (header->flags & MDNS_FLAGS_OPCODE)
+    return PACKET_UNSUPPORTED;
+  return PACKET_QUERY;
+}
+
+static double stats_ratio(uint64_t part, uint64_t total) {
+  return total ? (double)part / (double)total : 0.0;
+}
+
+static void stats_print(void) {
+  printf("Stats:\n");
+  printf("  datagrams received   %" PRIu64 " (%.2f per read)\n",
+         stats.datagrams, stats_ratio(stats.datagrams, stats.reads));
+  printf("  datagrams sent       %" PRIu64 " (%.2f per send)\n",
+         mdns_egress.datagrams,
+         stats_ratio(mdns_egress.datagrams,
+                     mdns_egress.batches + mdns_egress.unbatched));
+  printf("  datagrams oversized  %" PRIu64 "\n", stats.datagrams_oversized);
+  printf("  receive buffers      %zu of %zu used at most\n",
+         recv_pool.high_water, recv_pool.count);
+  printf("  receive pool empty   %" PRIu64 "\n", recv_pool.exhausted);
+  printf("  sent immediately     %" PRIu64 "\n", mdns_send_paths.immediate);
+  printf("  sent queued          %" PRIu64 "\n", mdns_send_paths.queued);
+  printf("  sends dropped        %" PRIu64 "\n", mdns_send_pool.exhausted);
+  printf("  reading paused       %" PRIu64 "\n", stats.recv_paused);
+  for (int i = 0; i < PACKET_CLASS_COUNT; i++) {
+    printf("  packets %-12s %" PRIu64 "\n", packet_class_names[i],
+           stats.packets[i]);
+  }
+  printf("  packets filtered     %" PRIu64 "\n", stats.packets_filtered);
+  printf("  filter checks        %" PRIu64 "\n", stats.filter_checks);
+  printf("  filter hits          %" PRIu64 " (%.3f)\n", stats.filter_hits,
+         stats_ratio(stats.filter_hits, stats.filter_checks));
+  printf("  filter false hits    %" PRIu64 " (%.3f)\n",
+         stats.filter_false_positives,
+         stats_ratio(stats.filter_false_positives, stats.filter_hits));
+  printf("  answer cache hits    %" PRIu64 " (%.3f)\n", response_cache.hits,
+         stats_ratio(response_cache.hits,
+                     response_cache.hits + response_cache.misses));
+  printf("  packet cache hits    %" PRIu64 " (%.3f)\n", packet_cache.hits,
+         stats_ratio(packet_cache.hits,
+                     packet_cache.hits + packet_cache.misses));
+  printf("  replays rate limited %" PRIu64 "\n", stats.replays_limited);
+  printf("  known answers        %" PRIu64 "\n", stats.known_answers);
+  printf("  answers suppressed   %" PRIu64 "\n", stats.answers_suppressed);
+  printf("  queries held         %" PRIu64 "\n", stats.queries_held);
+  printf("  answers delayed      %" PRIu64 "\n", response_scheduler.delayed);
+  printf("  answers merged       %" PRIu64 " (%.3f)\n",
+         response_scheduler.merged,
+         stats_ratio(response_scheduler.merged, response_scheduler.delayed));
+  printf("  answers cancelled    %" PRIu64 "\n", response_scheduler.cancelled);
+  printf("  records rate limited %" PRIu64 " (%.3f)\n", rate_limit.dropped,
+         stats_ratio(rate_limit.dropped,
+                     rate_limit.allowed + rate_limit.dropped));
+}
+
+// Remember every packet sent while answering a query in the packet cache
+static void on_packet_sent(const void *address, size_t address_size,
+                           const void *buffer, size_t size) {
+  packet_cache_record(&packet_cache, address != NULL, buffer, size);
+}
+
+// Look up which of our records are in the answer section of a packet,
+// storing the ones with at least half their TTL left: the known answers of a
+// query, or the answers of another responder. Names are decoded into the
+// label table after the questions of the packet.
+static size_t known_answers_find(const void *buffer, size_t size,
+                                 const struct mdns_header_t *header,
+                                 const mdns_record_t **records,
+                                 size_t capacity) {
+  if (!header->answer_rrs)
+    return 0;
+  mdns_known_answer_t answers[MAX_KNOWN_ANSWERS];
+  size_t answers_count = uvmdns_known_answers_parse(
+      buffer, size, header, &label_table, answers, MAX_KNOWN_ANSWERS);
+
+  size_t count = 0;
+  for (size_t i = 0; (i < answers_count) && (count < capacity); i++) {
+    const mdns_record_t *record = service_index_find_record(
+        &service_index, services, &label_table, buffer, &answers[i]);
+    if (!record ||
+        ((uint64_t)answers[i].ttl * 2 < mdns_record_multicast_ttl(record)))
+      continue;
+    records[count++] = record;
+  }
+  return count;
+}
+
+// Leave a record the querier holds out of both sets of answers
+static void packet_answers_known(const mdns_record_t *record) {
+  for (int i = 0; i < 2; i++)
+    response_builder_known(&packet_answers[i].builder, record);
+}
+
+// Milliseconds to wait for the rest of the known answers of a truncated
+// query, from 400 to 500 (RFC 6762 section 7.2)
+static uint64_t held_query_delay(void) {
+  return 400 + (uint64_t)(rand() % 101);
+}
+
+static void on_held_timer(uv_timer_t *timer);
+
+// Wake up when the first held query is due
+static void held_timer_update(void) {
+  const held_query_t *next = held_queries_next(&held_queries);
+  if (!next) {
+    uv_timer_stop(held_timer);
+    return;
+  }
+  uint64_t now = uv_now(uv_loop);
+  uint64_t timeout = (next->expires > now) ? (next->expires - now) : 0;
+  uv_timer_start(held_timer, on_held_timer, timeout, 0);
+}
+
+// Answer a query, leaving out the records the querier already holds: those
+// in its own answer section, and for a held truncated query those from the
+// packets that followed it. A truncated query that is not held yet is held
+// instead, when there is room.
+static void query_answer(uv_udp_t *handle, const struct sockaddr *addr,
+                         const char *buffer, size_t size,
+                         const struct mdns_header_t *header,
+                         const held_query_t *held) {
+  size_t addrlen = sizeof(struct sockaddr_in);
+  uint64_t now = uv_now(uv_loop);
+  bool truncated = (header->flags & MDNS_FLAGS_TRUNCATED);
+
+  mdns_question_t questions[MAX_QUESTIONS];
+  size_t question_count = uvmdns_questions_parse(
+      buffer, size, header, &label_table, questions, MAX_QUESTIONS);
+
+  // Most queries on a network are for names we do not own, check every name
+  // against the filter before doing any lookups
+  uint32_t hashes[MAX_QUESTIONS];
+  bool candidates[MAX_QUESTIONS];
+  size_t candidate_count = 0;
+  for (size_t iquestion = 0; iquestion < question_count; iquestion++) {
+    candidates[iquestion] =
+        service_index_filter(&service_index, &label_table, buffer,
+                             questions[iquestion].name_label,
+                             &hashes[iquestion]);
+    if (candidates[iquestion])
+      candidate_count++;
+  }
+  if (!held) {
+    stats.filter_checks += question_count;
+    stats.filter_hits += candidate_count;
+  }
+  if (!candidate_count) {
+    stats.packets_filtered++;
+    return;
+  }
+
+  if (truncated && !held) {
+    held_query_t *query = held_queries_add(
+        &held_queries, (const struct sockaddr_in *)addr, buffer, size,
+        now + held_query_delay());
+    if (query) {
+      stats.queries_held++;
+      held_timer_update();
+      return;
+    }
+  }
+
+  mdns_string_t fromaddrstr = ip_address_to_string(
+      fromaddrbuffer, sizeof(fromaddrbuffer), addr, addrlen);
+
+  // The answers to a truncated query depend on the packets following it
+  if (!truncated)
+    packet_cache_begin(&packet_cache, buffer, size, now);
+  packet_answers_reset();
+
+  // Records the querier lists with at least half their TTL left are not
+  // sent again (RFC 6762 section 7.1)
+  const mdns_record_t *known[MAX_KNOWN_ANSWERS];
+  size_t known_count =
+      known_answers_find(buffer, size, header, known, MAX_KNOWN_ANSWERS);
+  stats.known_answers += known_count;
+  for (size_t i = 0; i < known_count; i++)
+    packet_answers_known(known[i]);
+  for (size_t i = 0; held && (i < held->known_count); i++)
+    packet_answers_known(held->known[i]);
+
+  // Match each question name in place, then look up the services owning it
+  for (size_t iquestion = 0; iquestion < question_count; iquestion++) {
+    if (!candidates[iquestion])
+      continue;
+    const mdns_question_t *question = &questions[iquestion];
+    uint32_t hash = hashes[iquestion];
+    char namebuffer[256];
+    mdns_string_t name =
+        mdns_label_table_extract(&label_table, buffer, question->name_label,
+                                 namebuffer, sizeof(namebuffer));
+
+    // Types we have no records of are still looked up, a name of ours gets
+    // a negative answer
+    const char *record_name = record_type_name(question->rtype);
+    if (record_name)
+      printf("\nQuery %s %.*s from %.*s\n", record_name,
+             MDNS_STRING_FORMAT(name), MDNS_STRING_FORMAT(fromaddrstr));
+    else
+      printf("\nQuery type %d %.*s from %.*s\n", question->rtype,
+             MDNS_STRING_FORMAT(name), MDNS_STRING_FORMAT(fromaddrstr));
+
+    service_name_kind_t kind = SERVICE_NAME_NONE;
+    int found =
+        service_index_find(&service_index, services, &label_table, buffer,
+                           question->name_label, hash, &kind);
+    if (found >= 0) {
+      service_answer(question, &services[found], kind);
+      continue;
+    }
+
+    const service_type_t *type = service_index_find_type(
+        &service_index, &label_table, buffer, question->name_label, hash);
+    if (type) {
+      service_type_answer(question, type);
+      continue;
+    }
+
+    if (mdns_label_table_equal(&label_table, buffer, question->name_label,
+                               service_dns_sd_wire,
+                               sizeof(service_dns_sd_wire))) {
+      dns_sd_answer(question);
+      continue;
+    }
+    stats.filter_false_positives++;
     printf("I dont care about this packet\n");
   }
-  return 0;
+  // Probes carry the records they propose in the authority section
+  bool probe = (header->authority_rrs > 0);
+  uint64_t exhausted = mdns_send_pool.exhausted;
+  packet_answers_send(handle, addr, addrlen, header->query_id, buffer, probe);
+  // A replay would miss the answers dropped for want of a send request
+  if (mdns_send_pool.exhausted != exhausted)
+    packet_cache_cancel(&packet_cache);
+  packet_cache_commit(&packet_cache, now);
+}
+
+// Answer the held queries that are due
+static void on_held_timer(uv_timer_t *timer) {
+  uint64_t now = uv_now(uv_loop);
+  held_query_t *query;
+  while ((query = held_queries_next(&held_queries)) &&
+         (query->expires <= now)) {
+    struct mdns_header_t header;
+    if (uvmdns_header_parse(query->query, query->size, &header))
+      query_answer(server, (const struct sockaddr *)&query->from,
+                   query->query, query->size, &header, query);
+    held_queries_remove(&held_queries, query);
+  }
+  held_timer_update();
+}
+
+// A packet without questions continues the known-answer list of a truncated
+// query from the same sender, if one is held
+static void held_query_continue(const struct sockaddr *addr,
+                                const char *buffer, size_t size,
+                                const struct mdns_header_t *header) {
+  held_query_t *query =
+      held_queries_find(&held_queries, (const struct sockaddr_in *)addr);
+  if (!query)
+    return;
+  mdns_label_table_reset(&label_table);
+  const mdns_record_t *known[MAX_KNOWN_ANSWERS];
+  size_t known_count =
+      known_answers_find(buffer, size, header, known, MAX_KNOWN_ANSWERS);
+  stats.known_answers += known_count;
+  for (size_t i = 0; i < known_count; i++)
+    held_query_known(query, known[i]);
+  // More packets to come, wait for those too
+  if (header->flags & MDNS_FLAGS_TRUNCATED) {
+    query->expires = uv_now(uv_loop) + held_query_delay();
+    held_timer_update();
+  }
+}
+
+// Another responder multicasting a record we are about to send has answered
+// for us, cancel ours when it gave at least half our TTL (RFC 6762 section
+// 7.4). Only looked at while answers are pending.
+static void response_observe(const char *buffer, size_t size,
+                             const struct mdns_header_t *header) {
+  if (!response_scheduler.due)
+    return;
+  mdns_label_table_reset(&label_table);
+  const mdns_record_t *records[MAX_KNOWN_ANSWERS];
+  size_t count =
+      known_answers_find(buffer, size, header, records, MAX_KNOWN_ANSWERS);
+  for (size_t i = 0; i < count; i++)
+    response_scheduler_cancel(&response_scheduler, records[i]);
+}
+
+// Send the answers cached for a repeat of a query again, unless a record they
+// multicast went out too recently. Returns false if the query must be
+// answered anew instead, which leaves out the records rate limited.
+static bool packet_cache_replay(uv_udp_t *handle, const struct sockaddr *addr,
+                                const packet_cache_entry_t *cached,
+                                bool probe) {
+  uint64_t now = uv_now(uv_loop);
+  uint64_t interval = probe ? RATE_LIMIT_INTERVAL_PROBE : RATE_LIMIT_INTERVAL;
+  for (size_t i = 0; i < cached->slots_count; i++) {
+    if (!rate_limit_ready(&rate_limit, cached->slots[i], now, interval)) {
+      stats.replays_limited++;
+      return false;
+    }
+  }
+  for (size_t i = 0; i < cached->slots_count; i++)
+    rate_limit_allow(&rate_limit, cached->slots[i], now, interval);
+
+  size_t addrlen = sizeof(struct sockaddr_in);
+  for (size_t i = 0; i < cached->responses_count; i++) {
+    const packet_response_t *response = cached->responses[i];
+    if (response->unicast)
+      mdns_unicast_send(handle, addr, addrlen, response->data, response->size);
+    else
+      uvmdns_multicast_send(handle, response->data, response->size);
+  }
+  return true;
+}
+
+// Handle one received datagram, the buffer stays owned by on_recv
+static void packet_handle(uv_udp_t *req, const struct sockaddr *addr,
+                          const char *data, size_t size) {
+  struct mdns_header_t header;
+  packet_class_t packet_class = packet_classify(data, size, &header);
+  stats.packets[packet_class]++;
+  if (packet_class == PACKET_RESPONSE)
+    response_observe(data, size, &header);
+  if (packet_class != PACKET_QUERY) {
+    // Nothing to answer, drop before decoding any names
+    return;
+  }
+
+  if (!header.questions) {
+    held_query_continue(addr, data, size, &header);
+    return;
+  }
+
+  // A repeat of a query answered recently gets the same answers again
+  uint64_t now = uv_now(uv_loop);
+  const packet_cache_entry_t *cached =
+      (header.flags & MDNS_FLAGS_TRUNCATED)
+          ? NULL
+          : packet_cache_find(&packet_cache, data, size, now);
+  bool probe = (header.authority_rrs > 0);
+  if (cached && packet_cache_replay(req, addr, cached, probe))
+    return;
+
+  query_answer(req, addr, data, size, &header, NULL);
 }
 
+static void recv_buffer_release(char *buffer) {
+  if (recv_pool_put(&recv_pool, buffer) < 0)
+    fprintf(stderr, "Receive buffer given back twice or not pooled\n");
+}
+
+// With recvmmsg every datagram of a batch arrives flagged as a chunk of the
+// one buffer, which is handed back for freeing once the batch is done
 static void on_recv(uv_udp_t *req, ssize_t nread, const uv_buf_t *buf,
                     const struct sockaddr *addr, unsigned flags) {
   if (nread < 0) {
     fprintf(stderr, "Read error %s\n", uv_err_name(nread));
+    recv_buffer_release(buf->base);
     return;
   }
   if (nread == 0) {
-    if (buf != NULL && buf->base != NULL) {
-      free(buf->base);
+    // An empty datagram in a recvmmsg batch is a chunk of the batch buffer,
+    // which is only freed along with the batch
+    if (addr)
+      stats.datagrams++;
+    if ((flags & UV_UDP_MMSG_FREE) ||
+        (addr && !(flags & UV_UDP_MMSG_CHUNK)))
+      stats.reads++;
+    if (!(flags & UV_UDP_MMSG_CHUNK) && buf != NULL && buf->base != NULL) {
+      recv_buffer_release(buf->base);
     }
     return;
   }
+  if (!addr)
+    return;
 
+  /*
   char sender[17] = {0};
   uv_ip4_name((const struct sockaddr_in *)addr, sender, 16);
-  /*
   printf("Packet from %s (%lu)\n", sender, nread);
   printf("Size: %lu %.*s\n", nread, (int)nread, (char *)buf->base);
   for (int i = 0; i < nread; i++) {
@@ -309,33 +941,80 @@ static void on_recv(uv_udp_t *req, ssize_t nread, const uv_buf_t *buf,
   printf("\n");
   */
 
+  stats.datagrams++;
+  if ((flags & UV_UDP_PARTIAL) || (nread > RECV_PACKET_MAX))
+    stats.datagrams_oversized++;
+  else
+    packet_handle(req, addr, buf->base, (size_t)nread);
+  if (!(flags & UV_UDP_MMSG_CHUNK)) {
+    stats.reads++;
+    recv_buffer_release(buf->base);
+  }
+}
+
+// Multicast every record of every service in as few packets as they fit in,
+// all in the answer section as announcements have no question to answer.
+// Records are sent with the given class and TTL, a goodbye being a TTL of 0.
+static void services_announce(uint16_t rclass, uint32_t ttl) {
+  mdns_packet_builder_t builder;
+  mdns_packet_builder_init(&builder, server, NULL, 0, sendbuffer,
+                           sendbuffer_size, 0, NULL, 0);
+  builder.rclass = rclass;
+  builder.ttl = ttl;
+
   for (int i = 0; i < services_count; i++) {
-    mdns_data_t mdns_data = {0};
-    mdns_data.service = &services[i];
-    mdns_data.handle = req;
-    uvmdns_socket_recv(buf, addr, service_callback, &mdns_data);
+    const service_t *service = &services[i];
+    const mdns_record_t *records[4];
+    size_t records_count = 0;
+    records[records_count++] = &service->record_ptr;
+    records[records_count++] = &service->record_srv;
+    if (service->address_ipv4.sin_family == AF_INET)
+      records[records_count++] = &service->record_a;
+    records[records_count++] = &service->txt_record[0];
+
+    for (size_t irecord = 0; irecord < records_count; irecord++) {
+      if (mdns_packet_builder_add(&builder, records[irecord],
+                                  MDNS_ENTRYTYPE_ANSWER) < 0) {
+        fprintf(stderr, "Unable to announce %.*s\n",
+                MDNS_STRING_FORMAT(service->service_instance));
+        return;
+      }
+      // Announcements are not limited, but count as a multicast
+      if (ttl)
+        rate_limit_stamp(&rate_limit, records[irecord]->slot,
+                         uv_now(uv_loop));
+    }
+  }
+  if (mdns_packet_builder_finish(&builder) < 0) {
+    fprintf(stderr, "Unable to send announcement\n");
+    return;
   }
-  free(buf->base);
+  printf("Sent %d services in %zu packets\n", services_count, builder.packets);
+}
+
+// Number every record we multicast, for the state kept per record in flat
+// arrays. Returns the number of records.
+static size_t records_number(void) {
+  size_t count = 0;
+  for (int i = 0; i < services_count; i++) {
+    service_t *service = &services[i];
+    service->record_ptr.slot = count++;
+    service->record_srv.slot = count++;
+    service->record_a.slot = count++;
+    service->txt_record[0].slot = count++;
+    service->record_nsec_instance.slot = count++;
+    service->record_nsec_hostname.slot = count++;
+  }
+  for (size_t i = 0; i < service_index.types_count; i++)
+    service_index.types[i].record_dns_sd.slot = count++;
+  return count;
 }
 
 static void announce_services(uv_timer_t *timer) {
   uv_timer_stop(timer);
   uv_close((uv_handle_t *)timer, NULL);
   printf("Sending announce\n");
-
-  for (int i = 0; i < services_count; i++) {
-    service_t service = services[i];
-    mdns_record_t additional[5] = {0};
-    size_t additional_count = 0;
-    additional[additional_count++] = service.record_srv;
-    if (service.address_ipv4.sin_family == AF_INET)
-      additional[additional_count++] = service.record_a;
-    additional[additional_count++] = service.txt_record[0];
-
-    mdns_announce_multicast(server, service.buffer, service.buffer_size,
-                            service.record_ptr, 0, 0, additional,
-                            additional_count);
-  }
+  services_announce(MDNS_CLASS_IN | MDNS_CACHE_FLUSH, 60);
   printf("Announced!\n");
 }
 
@@ -343,20 +1022,8 @@ static void goodbye_services(uv_timer_t *timer) {
   uv_timer_stop(timer);
   uv_close((uv_handle_t *)timer, NULL);
   printf("Sending goodbye\n");
-
-  for (int i = 0; i < services_count; i++) {
-    service_t service = services[i];
-    mdns_record_t additional[5] = {0};
-    size_t additional_count = 0;
-    additional[additional_count++] = service.record_srv;
-    if (service.address_ipv4.sin_family == AF_INET)
-      additional[additional_count++] = service.record_a;
-    additional[additional_count++] = service.txt_record[0];
-
-    mdns_goodbye_multicast(server, service.buffer, service.buffer_size,
-                           service.record_ptr, 0, 0, additional,
-                           additional_count);
-  }
+  // Goodbye should have ttl of 0
+  services_announce(MDNS_CLASS_IN, 0);
   printf("Goodbyed!\n");
 }
 
@@ -368,8 +1035,10 @@ static void on_walk_cleanup(uv_handle_t *handle, void *data) {
 
 static void on_close() {
   printf("Closing, goodbye\n");
+  stats_print();
   uv_timer_start(goodbye_timer, goodbye_services, 0, 0);
   uv_run(uv_loop, UV_RUN_ONCE);
+  mdns_send_flush();
   uv_stop(uv_loop);
   uv_run(uv_loop, UV_RUN_DEFAULT);
   uv_walk(uv_loop, on_walk_cleanup, NULL);
@@ -381,9 +1050,24 @@ static void on_close() {
   for (int i = 0; i < services_count; i++) {
     service_free(&services[i]);
   }
+  service_index_free(&service_index);
+  response_cache_free(&response_cache);
+  packet_cache_clear(&packet_cache);
+  held_queries_clear(&held_queries);
+  response_scheduler_free(&response_scheduler);
+  rate_limit_free(&rate_limit);
+  recv_pool_free(&recv_pool);
+  mdns_send_pool_free();
+  for (int i = 0; i < 2; i++)
+    response_builder_free(&packet_answers[i].builder);
   free(services);
+  free(sendbuffer);
   free(announce_timer);
   free(goodbye_timer);
+  free(held_timer);
+  free(response_timer);
+  free(send_check);
+  free(send_prepare);
   free(server);
 }
 
@@ -399,12 +1083,38 @@ static void on_signal(uv_signal_t *signal, int signum) {
   }
 }
 
+static void on_stats_signal(uv_signal_t *signal, int signum) {
+  stats_print();
+}
+
 static void on_alloc(uv_handle_t *handle, size_t suggested_size,
                      uv_buf_t *buf) {
-  buf->base = calloc(1, suggested_size);
-  buf->len = suggested_size;
+  buf->base = recv_pool_get(&recv_pool);
+  buf->len = buf->base ? recv_pool.buffer_size : 0;
 }
 
+// Everything queued for sending while handling this loop iteration's packets
+// and timers goes out together. Reading stops while too few send requests
+// are free to answer another batch of queries, and starts again once the
+// sends libuv queued have completed.
+static void on_send_check(uv_check_t *check) {
+  mdns_send_flush();
+  bool low = (mdns_send_pool.free_count < SEND_POOL_RESERVE);
+  if (low && !recv_paused && !uv_is_closing((uv_handle_t *)server)) {
+    uv_udp_recv_stop(server);
+    recv_paused = true;
+    stats.recv_paused++;
+  } else if (!low && recv_paused && !uv_is_closing((uv_handle_t *)server)) {
+    uv_udp_recv_start(server, on_alloc, on_recv);
+    recv_paused = false;
+  }
+}
+
+// Timers run before the loop waits for packets, and the check handle only
+// after it, so whatever they queued is sent here instead of once the next
+// packet arrives
+static void on_send_prepare(uv_prepare_t *prepare) { mdns_send_flush(); }
+
 const char *argp_program_version = "mdns-mingler 1.0";
 const char *argp_program_bug_address = "Jack Burgess <me@jackburgess.dev>";
 
@@ -419,10 +1129,28 @@ static struct argp_option options[] = {
      .flags = OPTION_ARG_OPTIONAL,
      .doc = "Path to hosts file. Default './hosts'.",
      .group = 0},
+    {.name = "payload-size",
+     .key = 'p',
+     .arg = "BYTES",
+     .flags = 0,
+     .doc = "Largest UDP payload to send, from 512 to 8952 for jumbo frames. "
+            "Default 1440.",
+     .group = 0},
+    {.name = "response-delay",
+     .key = 'd',
+     .arg = "MIN-MAX",
+     .flags = 0,
+     .doc = "Window in milliseconds multicast answers with shared records are "
+            "randomly delayed by, to merge answers to several queries. 0-0 "
+            "answers immediately. Default 20-120.",
+     .group = 0},
     {0}};
 
 struct arguments {
   char *hosts;
+  size_t payload_size;
+  unsigned int delay_min;
+  unsigned int delay_max;
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -432,6 +1160,27 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   case 'h':
     arguments->hosts = arg;
     break;
+  case 'p': {
+    char *end;
+    unsigned long size = strtoul(arg, &end, 10);
+    if (*end || (size < PAYLOAD_SIZE_MIN) || (size > PAYLOAD_SIZE_MAX))
+      argp_error(state, "payload size must be from %d to %d bytes",
+                 PAYLOAD_SIZE_MIN, PAYLOAD_SIZE_MAX);
+    arguments->payload_size = size;
+    break;
+  }
+  case 'd': {
+    unsigned int min, max;
+    int length = 0;
+    if ((sscanf(arg, "%u-%u%n", &min, &max, &length) != 2) || arg[length] ||
+        (min > max) || (max > RESPONSE_DELAY_LIMIT))
+      argp_error(state, "response delay must be MIN-MAX milliseconds, at "
+                        "most %d",
+                 RESPONSE_DELAY_LIMIT);
+    arguments->delay_min = min;
+    arguments->delay_max = max;
+    break;
+  }
   default:
     return ARGP_ERR_UNKNOWN;
   }
@@ -444,9 +1193,19 @@ int main(int argc, char **argv) {
   struct arguments arguments;
   /* Default values */
   arguments.hosts = "./hosts";
+  arguments.payload_size = PAYLOAD_SIZE_DEFAULT;
+  arguments.delay_min = RESPONSE_DELAY_MIN;
+  arguments.delay_max = RESPONSE_DELAY_MAX;
 
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
+  sendbuffer_size = arguments.payload_size;
+  sendbuffer = malloc(sendbuffer_size);
+  if (mdns_send_pool_init(SEND_POOL_REQUESTS, sendbuffer_size) < 0) {
+    fprintf(stderr, "Unable to allocate send requests\n");
+    exit(EXIT_FAILURE);
+  }
+
   FILE *fp = fopen(arguments.hosts, "r");
   if (fp == NULL) {
     perror("Unable to open hosts file");
@@ -484,29 +1243,62 @@ int main(int argc, char **argv) {
     printf("Service: '%s.local' -> %s\n", host, ip);
     service_t service = service_create(ip, host);
     services[services_count++] = service;
+    if (!service_names_valid(&service)) {
+      fprintf(stderr, "Unable to encode the names of '%s'\n", host);
+      exit(EXIT_FAILURE);
+    }
   }
   fclose(fp);
 
+  if (service_index_build(&service_index, services, services_count) < 0) {
+    fprintf(stderr, "Unable to build service index\n");
+    exit(EXIT_FAILURE);
+  }
+  if (response_cache_init(&response_cache, services_count) < 0) {
+    fprintf(stderr, "Unable to allocate answer cache\n");
+    exit(EXIT_FAILURE);
+  }
+  packet_cache_clear(&packet_cache);
+  response_scheduler_init(&response_scheduler, arguments.delay_min,
+                          arguments.delay_max);
+  if (rate_limit_init(&rate_limit, records_number()) < 0) {
+    fprintf(stderr, "Unable to allocate rate limit\n");
+    exit(EXIT_FAILURE);
+  }
+  mdns_send_observer = on_packet_sent;
+
   uv_loop = uv_default_loop();
   int status;
 
-  uv_signal_t sigint, sigterm;
+  uv_signal_t sigint, sigterm, sigusr1;
   uv_signal_init(uv_loop, &sigint);
   uv_signal_start(&sigint, on_signal, SIGINT);
   uv_signal_init(uv_loop, &sigterm);
   uv_signal_start(&sigterm, on_signal, SIGTERM);
+  uv_signal_init(uv_loop, &sigusr1);
+  uv_signal_start(&sigusr1, on_stats_signal, SIGUSR1);
 
   server = malloc(sizeof(uv_udp_t));
 
   struct sockaddr_in addr;
   uv_ip4_addr("0.0.0.0", MDNS_PORT, &addr);
 
-  status = uv_udp_init(uv_loop, server);
+  status = uv_udp_init_ex(uv_loop, server, AF_UNSPEC | UV_UDP_RECVMMSG);
   UV_CHECK(status, "init");
   status =
       uv_udp_bind(server, (const struct sockaddr *)&addr, UV_UDP_REUSEADDR);
   UV_CHECK(status, "bind");
 
+  // With recvmmsg libuv splits each buffer into chunks as large as the
+  // largest UDP datagram, one per datagram read in the same system call.
+  // Otherwise a datagram larger than the buffer is cut short and dropped.
+  size_t recv_size = uv_udp_using_recvmmsg(server)
+                         ? RECV_DATAGRAM_SIZE * RECV_BATCH
+                         : RECV_PACKET_MAX;
+  if (recv_pool_init(&recv_pool, RECV_POOL_BUFFERS, recv_size) < 0) {
+    fprintf(stderr, "Unable to allocate receive buffers\n");
+    exit(EXIT_FAILURE);
+  }
   status = uv_udp_recv_start(server, on_alloc, on_recv);
   UV_CHECK(status, "recv");
 
@@ -520,6 +1312,27 @@ int main(int argc, char **argv) {
   status = uv_timer_init(uv_loop, goodbye_timer);
   UV_CHECK(status, "goodbye timer_init");
 
+  srand((unsigned int)uv_hrtime());
+  held_timer = malloc(sizeof(uv_timer_t));
+  status = uv_timer_init(uv_loop, held_timer);
+  UV_CHECK(status, "held timer_init");
+
+  response_timer = malloc(sizeof(uv_timer_t));
+  status = uv_timer_init(uv_loop, response_timer);
+  UV_CHECK(status, "response timer_init");
+
+  send_check = malloc(sizeof(uv_check_t));
+  status = uv_check_init(uv_loop, send_check);
+  UV_CHECK(status, "send check_init");
+  status = uv_check_start(send_check, on_send_check);
+  UV_CHECK(status, "send check_start");
+  send_prepare = malloc(sizeof(uv_prepare_t));
+  status = uv_prepare_init(uv_loop, send_prepare);
+  UV_CHECK(status, "send prepare_init");
+  status = uv_prepare_start(send_prepare, on_send_prepare);
+  UV_CHECK(status, "send prepare_start");
+  mdns_send_batched = 1;
+
   printf("Ready!\n");
   return uv_run(uv_loop, UV_RUN_DEFAULT);
 }
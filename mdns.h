@@ -14,6 +14,11 @@
 
 #pragma once
 
+// sendmmsg is a GNU extension
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -26,6 +31,7 @@
 #include <Ws2tcpip.h>
 #define strncasecmp _strnicmp
 #else
+#include <errno.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -50,7 +56,16 @@ extern "C" {
 #define MDNS_PORT 5353
 #define MDNS_UNICAST_RESPONSE 0x8000U
 #define MDNS_CACHE_FLUSH 0x8000U
+#define MDNS_FLAGS_RESPONSE 0x8000U
+#define MDNS_FLAGS_OPCODE 0x7800U
+#define MDNS_FLAGS_TRUNCATED 0x0200U
 #define MDNS_MAX_SUBSTRINGS 64
+#define MDNS_HASH_INIT 2166136261U
+#define MDNS_LABEL_TABLE_CAPACITY 256
+#define MDNS_LABEL_TABLE_SLOTS 512
+#define MDNS_LABEL_NONE 0xFFFFU
+#define MDNS_STRING_TABLE_CAPACITY 512
+#define MDNS_STRING_TABLE_SLOTS 1024
 
 enum mdns_record_type {
   MDNS_RECORDTYPE_IGNORE = 0,
@@ -64,6 +79,8 @@ enum mdns_record_type {
   MDNS_RECORDTYPE_AAAA = 28,
   // Server Selection [RFC2782]
   MDNS_RECORDTYPE_SRV = 33,
+  // Next secure, the types a name has [RFC6762]
+  MDNS_RECORDTYPE_NSEC = 47,
   // Any available records
   MDNS_RECORDTYPE_ANY = 255
 };
@@ -90,6 +107,9 @@ typedef int (*mdns_record_callback_fn)(int sock, const struct sockaddr *from,
                                        size_t record_offset,
                                        size_t record_length, void *user_data);
 
+typedef void (*mdns_send_observer_fn)(const void *address, size_t address_size,
+                                      const void *buffer, size_t size);
+
 typedef struct mdns_string_t mdns_string_t;
 typedef struct mdns_string_pair_t mdns_string_pair_t;
 typedef struct mdns_string_table_item_t mdns_string_table_item_t;
@@ -100,7 +120,13 @@ typedef struct mdns_record_ptr_t mdns_record_ptr_t;
 typedef struct mdns_record_a_t mdns_record_a_t;
 typedef struct mdns_record_aaaa_t mdns_record_aaaa_t;
 typedef struct mdns_record_txt_t mdns_record_txt_t;
+typedef struct mdns_record_nsec_t mdns_record_nsec_t;
 typedef struct mdns_query_t mdns_query_t;
+typedef struct mdns_question_t mdns_question_t;
+typedef struct mdns_known_answer_t mdns_known_answer_t;
+typedef struct mdns_label_t mdns_label_t;
+typedef struct mdns_label_table_t mdns_label_table_t;
+typedef struct mdns_packet_builder_t mdns_packet_builder_t;
 
 #ifdef _WIN32
 typedef int mdns_size_t;
@@ -121,10 +147,27 @@ struct mdns_string_pair_t {
   int ref;
 };
 
+// A name suffix written to a packet, identified by its first label and the
+// item holding the rest of the name
+struct mdns_string_table_item_t {
+  uint32_t key;
+  // Offset of the label length byte in the packet
+  uint16_t offset;
+  // Item of the rest of the name, MDNS_LABEL_NONE if the rest is the root
+  uint16_t next;
+};
+
+// Name compression dictionary for a packet being written. Every suffix of
+// every name written is kept, keyed by a hash chained from the root label by
+// label, so the longest suffix already in the packet is found with one lookup
+// per label. Reset between packets, once full further names are written
+// without being added.
 struct mdns_string_table_t {
-  size_t offset[16];
+  mdns_string_table_item_t items[MDNS_STRING_TABLE_CAPACITY];
   size_t count;
-  size_t next;
+  // Open addressing map from key to item index plus one, 0 marking an empty
+  // slot
+  uint16_t slots[MDNS_STRING_TABLE_SLOTS];
 };
 
 struct mdns_record_srv_t {
@@ -151,6 +194,14 @@ struct mdns_record_txt_t {
   mdns_string_t value;
 };
 
+// In mDNS the next domain name is the name of the record itself, and the
+// bitmap only lists types below 256 (RFC 6762 section 6.1). The bitmap is
+// kept encoded, see mdns_nsec_bitmap_encode.
+struct mdns_record_nsec_t {
+  mdns_string_t name;
+  mdns_string_t bitmap;
+};
+
 struct mdns_record_t {
   mdns_string_t name;
   mdns_record_type_t type;
@@ -160,9 +211,17 @@ struct mdns_record_t {
     mdns_record_a_t a;
     mdns_record_aaaa_t aaaa;
     mdns_record_txt_t txt;
+    mdns_record_nsec_t nsec;
   } data;
   uint16_t rclass;
   uint32_t ttl;
+  // RDATA already in wire format, written as is instead of being encoded
+  // from data. Only for records without names in their RDATA, as names are
+  // compressed against the rest of the packet.
+  mdns_string_t rdata;
+  // Position of the record in state the application keeps per record, such
+  // as when it was last multicast
+  uint32_t slot;
 };
 
 struct mdns_header_t {
@@ -180,6 +239,78 @@ struct mdns_query_t {
   size_t length;
 };
 
+struct mdns_question_t {
+  size_t name_offset;
+  size_t name_length;
+  // First label of the name in the packet label table
+  uint16_t name_label;
+  uint16_t rtype;
+  uint16_t rclass;
+};
+
+// A record from the answer section of a received packet. In a query these
+// are the records the querier already holds in its cache.
+struct mdns_known_answer_t {
+  uint16_t name_label;
+  uint16_t rtype;
+  uint16_t rclass;
+  uint32_t ttl;
+  size_t rdata_offset;
+  size_t rdata_length;
+  // First label of the name in the RDATA of a PTR or SRV record,
+  // MDNS_LABEL_NONE for other types
+  uint16_t rdata_label;
+};
+
+struct mdns_label_t {
+  // Offset of the first character of the label in the packet
+  uint16_t offset;
+  uint8_t length;
+  // Index of the following label, MDNS_LABEL_NONE after the last label
+  uint16_t next;
+};
+
+// Every label of every name in a packet, decoded once. Compression pointers
+// are resolved into next links when the table is built, so names sharing a
+// suffix share the labels of that suffix. A name is identified by the index
+// of its first label, MDNS_LABEL_NONE being the root name.
+struct mdns_label_table_t {
+  mdns_label_t labels[MDNS_LABEL_TABLE_CAPACITY];
+  size_t count;
+  // Open addressing map from the packet offset of a label length byte to its
+  // index in labels, offset 0 marking an empty slot
+  uint16_t slot_offset[MDNS_LABEL_TABLE_SLOTS];
+  uint16_t slot_label[MDNS_LABEL_TABLE_SLOTS];
+};
+
+// Writes records into packets of at most capacity bytes, sending a packet
+// when the next record does not fit and starting over in a new one. Records
+// must be added in section order, answers before additional records.
+struct mdns_packet_builder_t {
+  uv_udp_t *handle;
+  // Unicast destination, null to multicast
+  const void *address;
+  size_t address_size;
+  void *buffer;
+  size_t capacity;
+  uint16_t query_id;
+  // Echoed at the start of every unicast packet
+  const mdns_query_t *questions;
+  size_t question_count;
+  // Class and TTL applied to records without their own, for announcements.
+  // When rclass is 0 the usual answer class and TTL are used instead.
+  uint16_t rclass;
+  uint32_t ttl;
+  // State of the packet being written, data is null before it is started
+  mdns_string_table_t string_table;
+  void *data;
+  mdns_entry_type_t section;
+  uint16_t answer_rrs;
+  uint16_t additional_rrs;
+  // Packets sent so far
+  size_t packets;
+};
+
 // mDNS/DNS-SD public API
 
 //! Open and setup a IPv4 socket for mDNS/DNS-SD. To bind the socket to a
@@ -261,6 +392,32 @@ static inline int mdns_query_answer_multicast(
     const mdns_record_t *authority, size_t authority_count,
     const mdns_record_t *additional, size_t additional_count);
 
+//! Send a prepared answer unicast to the given address, or multicast if the
+//! address is null. The query ID is patched into the copy of the answer that
+//! is sent, the buffer is left untouched. Returns 0 if success, or <0 if
+//! error.
+static inline int mdns_answer_send(uv_udp_t *handle, const void *address,
+                                   size_t address_size, const void *buffer,
+                                   size_t size, uint16_t query_id);
+
+//! Send a prepared unicast answer to a single question like mdns_answer_send,
+//! echoing the question exactly as it was received. The question bytes are
+//! copied from the query over the ones in the answer when both are the same
+//! size, which they are when the name matched label by label and was not
+//! compressed in the query, otherwise the answer keeps its own question.
+static inline int mdns_answer_send_question(uv_udp_t *handle,
+                                            const void *address,
+                                            size_t address_size,
+                                            const void *buffer, size_t size,
+                                            uint16_t query_id,
+                                            const void *question,
+                                            size_t question_size);
+
+//! Get the lowest TTL of the answer records in an encoded response, the time
+//! the response as a whole stays valid. Returns 0 if the response has no
+//! answers or is malformed.
+static inline uint32_t mdns_answer_ttl(const void *buffer, size_t size);
+
 //! Send a variable multicast mDNS announcement (as an unsolicited answer) with
 //! variable number of records.Buffer must be 32 bit aligned. Returns 0 if
 //! success, or <0 if error. Use this on service startup to announce your
@@ -282,6 +439,69 @@ static inline int mdns_goodbye_multicast(uv_udp_t *handle, void *buffer,
                                          const mdns_record_t *additional,
                                          size_t additional_count);
 
+//! Send a mDNS answer with any number of answer and additional records, split
+//! at record boundaries over as few packets of at most capacity bytes as
+//! possible. Answer records are written first, additional records fill the
+//! remaining space and spill into further packets. If address is given the
+//! answer is a unicast reply echoing the given questions, otherwise it is
+//! multicast and the questions are ignored. Returns 0 if success, or <0 if
+//! error.
+static inline int mdns_answer_records(
+    uv_udp_t *handle, const void *address, size_t address_size, void *buffer,
+    size_t capacity, uint16_t query_id, const mdns_query_t *questions,
+    size_t question_count, const mdns_record_t *const *answers,
+    size_t answer_count, const mdns_record_t *const *additional,
+    size_t additional_count);
+
+//! Start building packets of at most capacity bytes in the given buffer. If
+//! address is given the packets are unicast replies echoing the given
+//! questions, otherwise they are multicast and the questions are ignored.
+//! Without a handle nothing is sent, see mdns_packet_builder_close.
+static inline void mdns_packet_builder_init(
+    mdns_packet_builder_t *builder, uv_udp_t *handle, const void *address,
+    size_t address_size, void *buffer, size_t capacity, uint16_t query_id,
+    const mdns_query_t *questions, size_t question_count);
+
+//! Add a record to the answer or additional section, sending the current
+//! packet first if the record does not fit in it. Returns 0 if success, or <0
+//! if the record does not fit an empty packet, is added out of section order,
+//! or a send failed.
+static inline int mdns_packet_builder_add(mdns_packet_builder_t *builder,
+                                          const mdns_record_t *record,
+                                          mdns_entry_type_t section);
+
+//! Send the last packet, if it has any records. Returns 0 if success, or <0 if
+//! error.
+static inline int mdns_packet_builder_finish(mdns_packet_builder_t *builder);
+
+//! Fill in the record counts of the current packet without sending it, for a
+//! builder initialized without a handle which only writes a single packet.
+//! Returns the size of the packet, or 0 if it has no records.
+static inline size_t mdns_packet_builder_close(mdns_packet_builder_t *builder);
+
+//! Encode the RDATA of an A, AAAA or TXT record in wire format, for storing
+//! in the rdata field of the record. Returns the size of the RDATA, or 0 if
+//! the record type has names in its RDATA or the buffer is too small.
+static inline size_t mdns_record_rdata_encode(const mdns_record_t *record,
+                                              void *buffer, size_t capacity);
+
+//! Encode the type bitmap of an NSEC record listing the given types, all of
+//! which must be below 256. Returns the size of the bitmap, or 0 if a type is
+//! out of range or the buffer is too small.
+static inline size_t mdns_nsec_bitmap_encode(const uint16_t *types,
+                                             size_t count, void *buffer,
+                                             size_t capacity);
+
+//! Write a record with the given class and TTL, using its pre-encoded RDATA
+//! if any. Returns the end of the record, or null if it does not fit.
+static inline void *mdns_record_write(void *buffer, size_t capacity, void *data,
+                                      const mdns_record_t *record,
+                                      uint16_t rclass, uint32_t ttl,
+                                      mdns_string_table_t *string_table);
+
+//! TTL a record is multicast with when answering a query
+static inline uint32_t mdns_record_multicast_ttl(const mdns_record_t *record);
+
 // Parse records functions
 
 //! Parse a PTR record, returns the name in the record
@@ -324,6 +544,12 @@ static inline int mdns_string_skip(const void *buffer, size_t size,
 static inline size_t mdns_string_find(const char *str, size_t length, char c,
                                       size_t offset);
 
+//! Hash a possibly compressed name in place, following compression pointers.
+//! The hash is FNV-1a over the lower-cased labels joined by dots, without a
+//! trailing dot. Returns 0 if the name is malformed, >0 if the hash was set.
+static inline int mdns_string_hash(const void *buffer, size_t size,
+                                   size_t offset, uint32_t *hash);
+
 //! Compare if two strings are equal. If the strings are equal it returns >0 and
 //! the offset variables are updated to the end of the corresponding strings. If
 //! the strings are not equal it returns 0 and the offset variables are NOT
@@ -336,17 +562,72 @@ static inline void *mdns_string_make(void *buffer, size_t capacity, void *data,
                                      const char *name, size_t length,
                                      mdns_string_table_t *string_table);
 
-static inline size_t mdns_string_table_find(mdns_string_table_t *string_table,
-                                            const void *buffer, size_t capacity,
-                                            const char *str,
-                                            size_t first_length,
-                                            size_t total_length);
+//! Clear a name compression dictionary before writing a new packet
+static inline void mdns_string_table_reset(mdns_string_table_t *string_table);
+
+static inline uint16_t mdns_string_table_find(
+    const mdns_string_table_t *string_table, const void *buffer,
+    uint32_t key, const char *label, size_t length, uint16_t next);
 
 static inline size_t uvmdns_socket_recv(const uv_buf_t *buf,
                                         const struct sockaddr *addr,
                                         mdns_record_callback_fn callback,
                                         void *user_data);
 
+//! Decode the header of a received packet into host byte order, without
+//! looking at any of its sections. Returns 0 if the packet is too short.
+static inline int uvmdns_header_parse(const void *buffer, size_t size,
+                                      struct mdns_header_t *header);
+
+//! Decode the question section of a received packet in a single pass, given
+//! its header from uvmdns_header_parse. Up to capacity questions of class IN
+//! or ANY are stored in the supplied array, with their names decoded into the
+//! label table, which is reset first. Answer, authority and additional
+//! records are not touched. Returns the number of questions stored.
+static inline size_t uvmdns_questions_parse(const void *buffer, size_t size,
+                                            const struct mdns_header_t *header,
+                                            mdns_label_table_t *table,
+                                            mdns_question_t *questions,
+                                            size_t capacity);
+
+//! Decode the answer section of a received packet, such as the known answers
+//! of a query, after uvmdns_questions_parse has decoded the questions. Names,
+//! including those in PTR and SRV RDATA, are added to the same label table.
+//! Up to capacity records are stored. Returns the number of records stored.
+static inline size_t
+uvmdns_known_answers_parse(const void *buffer, size_t size,
+                           const struct mdns_header_t *header,
+                           mdns_label_table_t *table,
+                           mdns_known_answer_t *answers, size_t capacity);
+
+//! Clear a label table before decoding a new packet into it
+static inline void mdns_label_table_reset(mdns_label_table_t *table);
+
+//! Decode the name at offset into the label table, resolving each compression
+//! pointer once. Labels already decoded from earlier names are reused rather
+//! than walked again. On success the offset is moved past the name, the first
+//! label is stored in label and >0 is returned. Returns 0 for a malformed name
+//! or when the table is full.
+static inline int mdns_label_table_add(mdns_label_table_t *table,
+                                       const void *buffer, size_t size,
+                                       size_t *offset, uint16_t *label);
+
+//! Hash a name from the label table, identical to mdns_string_hash
+static inline uint32_t mdns_label_table_hash(const mdns_label_table_t *table,
+                                             const void *buffer,
+                                             uint16_t label);
+
+//! Compare a name from the label table with an uncompressed label sequence,
+//! ignoring case. Returns >0 if equal.
+static inline int mdns_label_table_equal(const mdns_label_table_t *table,
+                                         const void *buffer, uint16_t label,
+                                         const void *name, size_t length);
+
+//! Format a name from the label table as a dotted string
+static inline mdns_string_t
+mdns_label_table_extract(const mdns_label_table_t *table, const void *buffer,
+                         uint16_t label, char *str, size_t capacity);
+
 // Implementations
 
 static inline uint16_t mdns_ntohs(const void *data) {
@@ -578,6 +859,44 @@ static inline int mdns_string_skip(const void *buffer, size_t size,
   return 1;
 }
 
+static inline uint32_t mdns_hash_update(uint32_t hash, const void *data,
+                                        size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < length; ++i) {
+    uint8_t c = bytes[i];
+    if ((c >= 'A') && (c <= 'Z'))
+      c |= 0x20;
+    hash ^= c;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static inline int mdns_string_hash(const void *buffer, size_t size,
+                                   size_t offset, uint32_t *hash) {
+  uint32_t value = MDNS_HASH_INIT;
+  size_t cur = offset;
+  mdns_string_pair_t substr;
+  unsigned int counter = 0;
+  do {
+    substr = mdns_get_next_substring(buffer, size, cur);
+    if ((substr.offset == MDNS_INVALID_POS) ||
+        (counter++ > MDNS_MAX_SUBSTRINGS))
+      return 0;
+    if (substr.length) {
+      if (counter > 1)
+        value = mdns_hash_update(value, ".", 1);
+      value = mdns_hash_update(
+          value, MDNS_POINTER_OFFSET_CONST(buffer, substr.offset),
+          substr.length);
+    }
+    cur = substr.offset + substr.length;
+  } while (substr.length);
+
+  *hash = value;
+  return 1;
+}
+
 static inline int mdns_string_equal(const void *buffer_lhs, size_t size_lhs,
                                     size_t *ofs_lhs, const void *buffer_rhs,
                                     size_t size_rhs, size_t *ofs_rhs) {
@@ -662,66 +981,58 @@ static inline mdns_string_t mdns_string_extract(const void *buffer, size_t size,
   return result;
 }
 
-static inline size_t mdns_string_table_find(mdns_string_table_t *string_table,
-                                            const void *buffer, size_t capacity,
-                                            const char *str,
-                                            size_t first_length,
-                                            size_t total_length) {
-  if (!string_table)
-    return MDNS_INVALID_POS;
-
-  for (size_t istr = 0; istr < string_table->count; ++istr) {
-    if (string_table->offset[istr] >= capacity)
-      continue;
-    size_t offset = 0;
-    mdns_string_pair_t sub_string =
-        mdns_get_next_substring(buffer, capacity, string_table->offset[istr]);
-    if (!sub_string.length || (sub_string.length != first_length))
-      continue;
-    if (memcmp(str, MDNS_POINTER_OFFSET(buffer, sub_string.offset),
-               sub_string.length))
-      continue;
+static inline void mdns_string_table_reset(mdns_string_table_t *string_table) {
+  string_table->count = 0;
+  memset(string_table->slots, 0, sizeof(string_table->slots));
+}
 
-    // Initial substring matches, now match all remaining substrings
-    offset += first_length + 1;
-    while (offset < total_length) {
-      size_t dot_pos = mdns_string_find(str, total_length, '.', offset);
-      if (dot_pos == MDNS_INVALID_POS)
-        dot_pos = total_length;
-      size_t current_length = dot_pos - offset;
-
-      sub_string = mdns_get_next_substring(
-          buffer, capacity, sub_string.offset + sub_string.length);
-      if (!sub_string.length || (sub_string.length != current_length))
-        break;
-      if (memcmp(str + offset, MDNS_POINTER_OFFSET(buffer, sub_string.offset),
-                 sub_string.length))
-        break;
+// Key of a name suffix, from its first label and the key of the rest
+static inline uint32_t mdns_string_table_key(uint32_t next_key,
+                                             const char *label,
+                                             size_t length) {
+  return mdns_hash_update(next_key ^ (uint32_t)length, label, length);
+}
 
-      offset = dot_pos + 1;
-    }
+static inline size_t mdns_string_table_slot(uint32_t key) {
+  return (key ^ (key >> 16)) & (MDNS_STRING_TABLE_SLOTS - 1);
+}
 
-    // Return reference offset if entire string matches
-    if (offset >= total_length)
-      return string_table->offset[istr];
+static inline uint16_t mdns_string_table_find(
+    const mdns_string_table_t *string_table, const void *buffer,
+    uint32_t key, const char *label, size_t length, uint16_t next) {
+  size_t slot = mdns_string_table_slot(key);
+  uint16_t entry;
+  while ((entry = string_table->slots[slot])) {
+    const mdns_string_table_item_t *item = &string_table->items[entry - 1];
+    const uint8_t *written =
+        (const uint8_t *)MDNS_POINTER_OFFSET_CONST(buffer, item->offset);
+    if ((item->key == key) && (item->next == next) && (*written == length) &&
+        !memcmp(written + 1, label, length))
+      return entry - 1;
+    slot = (slot + 1) & (MDNS_STRING_TABLE_SLOTS - 1);
   }
-
-  return MDNS_INVALID_POS;
+  return MDNS_LABEL_NONE;
 }
 
-static inline void mdns_string_table_add(mdns_string_table_t *string_table,
-                                         size_t offset) {
-  if (!string_table)
-    return;
-
-  string_table->offset[string_table->next] = offset;
-
-  size_t table_capacity =
-      sizeof(string_table->offset) / sizeof(string_table->offset[0]);
-  if (++string_table->count > table_capacity)
-    string_table->count = table_capacity;
-  if (++string_table->next >= table_capacity)
-    string_table->next = 0;
+static inline uint16_t mdns_string_table_add(mdns_string_table_t *string_table,
+                                             uint32_t key, size_t offset,
+                                             uint16_t next) {
+  // Compression pointers hold 14 bit offsets
+  if ((string_table->count == MDNS_STRING_TABLE_CAPACITY) ||
+      (offset > 0x3FFF))
+    return MDNS_LABEL_NONE;
+
+  uint16_t index = (uint16_t)string_table->count++;
+  mdns_string_table_item_t *item = &string_table->items[index];
+  item->key = key;
+  item->offset = (uint16_t)offset;
+  item->next = next;
+
+  size_t slot = mdns_string_table_slot(key);
+  while (string_table->slots[slot])
+    slot = (slot + 1) & (MDNS_STRING_TABLE_SLOTS - 1);
+  string_table->slots[slot] = index + 1;
+  return index;
 }
 
 static inline size_t mdns_string_find(const char *str, size_t length, char c,
@@ -745,38 +1056,84 @@ static inline void *mdns_string_make_ref(void *data, size_t capacity,
 static inline void *mdns_string_make(void *buffer, size_t capacity, void *data,
                                      const char *name, size_t length,
                                      mdns_string_table_t *string_table) {
-  size_t last_pos = 0;
   size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-  if (name[length - 1] == '.')
+  if (length && (name[length - 1] == '.'))
     --length;
+
+  // Split the name into labels
+  size_t label_offset[MDNS_MAX_SUBSTRINGS];
+  size_t label_length[MDNS_MAX_SUBSTRINGS];
+  size_t labels = 0;
+  size_t last_pos = 0;
   while (last_pos < length) {
+    if (labels == MDNS_MAX_SUBSTRINGS)
+      return 0;
     size_t pos = mdns_string_find(name, length, '.', last_pos);
-    size_t sub_length = ((pos != MDNS_INVALID_POS) ? pos : length) - last_pos;
-    size_t total_length = length - last_pos;
+    if (pos == MDNS_INVALID_POS)
+      pos = length;
+    label_offset[labels] = last_pos;
+    label_length[labels++] = pos - last_pos;
+    last_pos = pos + 1;
+  }
+
+  // Key every suffix, chained from the root label
+  uint32_t key[MDNS_MAX_SUBSTRINGS];
+  uint32_t next_key = MDNS_HASH_INIT;
+  for (size_t ilabel = labels; ilabel-- > 0;) {
+    key[ilabel] = mdns_string_table_key(next_key, name + label_offset[ilabel],
+                                        label_length[ilabel]);
+    next_key = key[ilabel];
+  }
 
-    size_t ref_offset = mdns_string_table_find(
-        string_table, buffer, capacity,
-        (char *)MDNS_POINTER_OFFSET(name, last_pos), sub_length, total_length);
-    if (ref_offset != MDNS_INVALID_POS)
-      return mdns_string_make_ref(data, remain, ref_offset);
+  // Find the longest suffix already in the packet, walking from the root
+  uint16_t ref = MDNS_LABEL_NONE;
+  size_t written = labels;
+  while (string_table && written) {
+    size_t ilabel = written - 1;
+    uint16_t found = mdns_string_table_find(
+        string_table, buffer, key[ilabel], name + label_offset[ilabel],
+        label_length[ilabel], ref);
+    if (found == MDNS_LABEL_NONE)
+      break;
+    ref = found;
+    written = ilabel;
+  }
 
+  // Write the labels before the suffix
+  void *start = data;
+  for (size_t ilabel = 0; ilabel < written; ++ilabel) {
+    size_t sub_length = label_length[ilabel];
     if (remain <= (sub_length + 1))
       return 0;
-
     *(unsigned char *)data = (unsigned char)sub_length;
-    memcpy(MDNS_POINTER_OFFSET(data, 1), name + last_pos, sub_length);
-    mdns_string_table_add(string_table, MDNS_POINTER_DIFF(data, buffer));
-
+    memcpy(MDNS_POINTER_OFFSET(data, 1), name + label_offset[ilabel],
+           sub_length);
     data = MDNS_POINTER_OFFSET(data, sub_length + 1);
-    last_pos = ((pos != MDNS_INVALID_POS) ? pos + 1 : length);
-    remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+    remain -= sub_length + 1;
   }
 
-  if (!remain)
+  if (ref != MDNS_LABEL_NONE) {
+    data = mdns_string_make_ref(data, remain,
+                                string_table->items[ref].offset);
+  } else if (remain) {
+    *(unsigned char *)data = 0;
+    data = MDNS_POINTER_OFFSET(data, 1);
+  } else {
+    data = 0;
+  }
+  if (!data)
     return 0;
 
-  *(unsigned char *)data = 0;
-  return MDNS_POINTER_OFFSET(data, 1);
+  // Add the written suffixes, the rest of each name first. Labels are at the
+  // same distance from each other as in the dotted name.
+  size_t offset = MDNS_POINTER_DIFF(start, buffer);
+  for (size_t ilabel = written; string_table && ilabel-- > 0;) {
+    ref = mdns_string_table_add(string_table, key[ilabel],
+                                offset + label_offset[ilabel], ref);
+    if (ref == MDNS_LABEL_NONE)
+      break;
+  }
+  return data;
 }
 
 static inline size_t
@@ -816,58 +1173,284 @@ mdns_records_parse(int sock, const struct sockaddr *from, size_t addrlen,
   return parsed;
 }
 
+// Send requests come together with a copy of the payload, as the send may
+// still be queued when the caller reuses its buffer
+typedef struct mdns_send_t {
+  uv_udp_send_t req;
+  struct mdns_send_t *next;
+  char payload[];
+} mdns_send_t;
+
+// Send requests preallocated by mdns_send_pool_init, each owning room for
+// the largest payload until its send completes. Without a pool every send
+// allocates its own.
+typedef struct {
+  char *block;
+  size_t stride;
+  size_t count;
+  size_t payload_size;
+  mdns_send_t *free;
+  size_t free_count;
+  // Sends dropped because every request was in use
+  uint64_t exhausted;
+} mdns_send_pool_t;
+
+static mdns_send_pool_t mdns_send_pool = {0};
+
+static inline int mdns_send_pool_init(size_t count, size_t payload_size) {
+  mdns_send_pool_t *pool = &mdns_send_pool;
+  // Keep every request aligned as malloc would
+  size_t stride = (sizeof(mdns_send_t) + payload_size + 15) & ~(size_t)15;
+  pool->block = (char *)malloc(count * stride);
+  if (!pool->block)
+    return -1;
+  pool->stride = stride;
+  pool->count = count;
+  pool->payload_size = payload_size;
+  pool->free = NULL;
+  for (size_t i = count; i > 0; i--) {
+    mdns_send_t *send = (mdns_send_t *)(pool->block + (i - 1) * stride);
+    send->next = pool->free;
+    pool->free = send;
+  }
+  pool->free_count = count;
+  pool->exhausted = 0;
+  return 0;
+}
+
+static inline void mdns_send_pool_free(void) {
+  free(mdns_send_pool.block);
+  memset(&mdns_send_pool, 0, sizeof(mdns_send_pool));
+}
+
+static inline void mdns_send_flush(void);
+
+// Copy a payload into a send request, returns a null buffer if none is free.
+// Sending the queued datagrams first may give some back.
+static inline uv_buf_t mdns_send_alloc(uv_udp_send_t **req, const void *buffer,
+                                       size_t size) {
+  mdns_send_pool_t *pool = &mdns_send_pool;
+  mdns_send_t *send;
+  if (pool->block && (size <= pool->payload_size)) {
+    if (!pool->free)
+      mdns_send_flush();
+    send = pool->free;
+    if (!send) {
+      pool->exhausted++;
+      return uv_buf_init(NULL, 0);
+    }
+    pool->free = send->next;
+    pool->free_count--;
+  } else {
+    send = (mdns_send_t *)malloc(sizeof(mdns_send_t) + size);
+    if (!send)
+      return uv_buf_init(NULL, 0);
+  }
+  memcpy(send->payload, buffer, size);
+  *req = &send->req;
+  return uv_buf_init(send->payload, (unsigned int)size);
+}
+
+// Give back a send request once its send has completed or failed
+static inline void mdns_send_release(uv_udp_send_t *req) {
+  mdns_send_pool_t *pool = &mdns_send_pool;
+  mdns_send_t *send = (mdns_send_t *)req;
+  char *address = (char *)send;
+  if (pool->block && (address >= pool->block) &&
+      (address < pool->block + pool->count * pool->stride)) {
+    send->next = pool->free;
+    pool->free = send;
+    pool->free_count++;
+    return;
+  }
+  free(send);
+}
+
 static void on_send(uv_udp_send_t *req, int status) {
-  free(req);
+  mdns_send_release(req);
   if (status) {
     fprintf(stderr, "uv_udp_send_cb error: %s\n", uv_strerror(status));
   }
 }
 
+// Observer called with every packet queued for sending, with a null address
+// for multicast, e.g. to remember the answers sent for a query
+static mdns_send_observer_fn mdns_send_observer = 0;
+
+// Datagrams sent by uv_udp_try_send as they were handed over, and the ones
+// left to uv_udp_send as the socket would have blocked
+typedef struct {
+  uint64_t immediate;
+  uint64_t queued;
+} mdns_send_paths_t;
+
+static mdns_send_paths_t mdns_send_paths = {0};
+
+// Datagrams held for mdns_send_flush before it must be called early
+#define MDNS_EGRESS_CAPACITY 64
+
+typedef struct {
+  uv_udp_send_t *req;
+  uv_buf_t buf;
+  struct sockaddr_storage address;
+  size_t address_size;
+} mdns_egress_entry_t;
+
+// Datagrams queued on one socket since the last flush, sent together with a
+// single sendmmsg call where the platform has it
+typedef struct {
+  uv_udp_t *handle;
+  mdns_egress_entry_t entries[MDNS_EGRESS_CAPACITY];
+  size_t count;
+  // Datagrams flushed, the sendmmsg calls sending them, and the ones sent
+  // one at a time instead
+  uint64_t datagrams;
+  uint64_t batches;
+  uint64_t unbatched;
+} mdns_egress_t;
+
+// Set once something calls mdns_send_flush every loop iteration, e.g. from a
+// uv_check_t. Until then every datagram is sent as it is queued.
+static int mdns_send_batched = 0;
+static mdns_egress_t mdns_egress = {0};
+
+// Queue a send allocated by mdns_send_alloc, to the mDNS multicast group if
+// the address is null
+static inline int mdns_send_queue(uv_udp_t *handle, const void *address,
+                                  size_t address_size, uv_udp_send_t *send_req,
+                                  uv_buf_t send_buf);
+
 static inline int mdns_unicast_send(uv_udp_t *handle, const void *address,
                                     size_t address_size, const void *buffer,
                                     size_t size) {
 
-  uv_udp_send_t *send_req = (uv_udp_send_t *)malloc(sizeof(uv_udp_send_t));
-  uv_buf_t send_buf = uv_buf_init((char *)buffer, size);
-
-  int ret = uv_udp_send(send_req, handle, &send_buf, 1,
-                        (const struct sockaddr *)address, on_send);
-  if (ret < 0) {
-    fprintf(stderr, "Send error: %s\n", uv_strerror(ret));
+  uv_udp_send_t *send_req;
+  uv_buf_t send_buf = mdns_send_alloc(&send_req, buffer, size);
+  if (!send_buf.base)
     return -1;
-  }
-  return 0;
+  return mdns_send_queue(handle, address, address_size, send_req, send_buf);
 }
 
 /*
  * Now with added libuv! Badly, too!
  */
+static inline void uvmdns_multicast_address(struct sockaddr_in *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
+  addr->sin_port = htons((unsigned short)MDNS_PORT);
+}
+
 static inline int uvmdns_multicast_send(uv_udp_t *handle, const void *buffer,
                                         size_t size) {
-  struct sockaddr_storage addr_storage;
-  struct sockaddr_in addr;
-  struct sockaddr *saddr = (struct sockaddr *)&addr_storage;
-
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
-  addr.sin_port = htons((unsigned short)MDNS_PORT);
-  saddr = (struct sockaddr *)&addr;
-
-  char sender[17] = {0};
-  uv_ip4_name(&addr, sender, 16);
+  uv_udp_send_t *send_req;
+  uv_buf_t send_buf = mdns_send_alloc(&send_req, buffer, size);
+  if (!send_buf.base)
+    return -1;
+  return mdns_send_queue(handle, 0, 0, send_req, send_buf);
+}
 
-  uv_udp_send_t *send_req = (uv_udp_send_t *)malloc(sizeof(uv_udp_send_t));
-  uv_buf_t send_buf = uv_buf_init((char *)buffer, size);
+// Send a datagram right away if the socket takes it, otherwise queue the
+// send with its request until the socket is writable again
+static inline int mdns_send_now(uv_udp_t *handle, const void *address,
+                                uv_udp_send_t *send_req, uv_buf_t send_buf) {
+  int ret = uv_udp_try_send(handle, &send_buf, 1,
+                            (const struct sockaddr *)address);
+  if (ret >= 0) {
+    mdns_send_release(send_req);
+    mdns_send_paths.immediate++;
+    return 0;
+  }
+  if (ret == UV_EAGAIN) {
+    ret = uv_udp_send(send_req, handle, &send_buf, 1,
+                      (const struct sockaddr *)address, on_send);
+    if (ret >= 0) {
+      mdns_send_paths.queued++;
+      return 0;
+    }
+  }
+  mdns_send_release(send_req);
+  fprintf(stderr, "Send error: %s\n", uv_strerror(ret));
+  return -1;
+}
 
-  int ret = uv_udp_send(send_req, handle, &send_buf, 1, saddr, on_send);
-  if (ret < 0) {
-    fprintf(stderr, "Send error: %s\n", uv_strerror(ret));
-    return -1;
+static inline int mdns_send_queue(uv_udp_t *handle, const void *address,
+                                  size_t address_size, uv_udp_send_t *send_req,
+                                  uv_buf_t send_buf) {
+  if (mdns_send_observer)
+    mdns_send_observer(address, address_size, send_buf.base, send_buf.len);
+
+  struct sockaddr_in multicast;
+  if (!address) {
+    uvmdns_multicast_address(&multicast);
+    address = &multicast;
+    address_size = sizeof(multicast);
   }
+  if (!mdns_send_batched || (address_size > sizeof(struct sockaddr_storage)))
+    return mdns_send_now(handle, address, send_req, send_buf);
+
+  mdns_egress_t *egress = &mdns_egress;
+  if ((egress->count == MDNS_EGRESS_CAPACITY) ||
+      (egress->count && (egress->handle != handle)))
+    mdns_send_flush();
+  mdns_egress_entry_t *entry = &egress->entries[egress->count++];
+  egress->handle = handle;
+  entry->req = send_req;
+  entry->buf = send_buf;
+  memcpy(&entry->address, address, address_size);
+  entry->address_size = address_size;
   return 0;
 }
 
+// Send every queued datagram, with as few sendmmsg calls as the socket takes
+// them in. Whatever it does not take right away, and everything on other
+// platforms, is sent one at a time.
+static inline void mdns_send_flush(void) {
+  mdns_egress_t *egress = &mdns_egress;
+  if (!egress->count)
+    return;
+  size_t sent = 0;
+#ifdef __linux__
+  uv_os_fd_t fd;
+  // Sends libuv still has queued go first, writing past them would reorder
+  if (!uv_udp_get_send_queue_count(egress->handle) &&
+      !uv_fileno((const uv_handle_t *)egress->handle, &fd)) {
+    struct mmsghdr messages[MDNS_EGRESS_CAPACITY];
+    struct iovec iov[MDNS_EGRESS_CAPACITY];
+    memset(messages, 0, egress->count * sizeof(struct mmsghdr));
+    for (size_t i = 0; i < egress->count; i++) {
+      mdns_egress_entry_t *entry = &egress->entries[i];
+      iov[i].iov_base = entry->buf.base;
+      iov[i].iov_len = entry->buf.len;
+      messages[i].msg_hdr.msg_name = &entry->address;
+      messages[i].msg_hdr.msg_namelen = (socklen_t)entry->address_size;
+      messages[i].msg_hdr.msg_iov = &iov[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < egress->count) {
+      int ret = sendmmsg(fd, messages + sent,
+                         (unsigned int)(egress->count - sent), 0);
+      if ((ret < 0) && (errno == EINTR))
+        continue;
+      if (ret <= 0)
+        break;
+      egress->batches++;
+      for (int i = 0; i < ret; i++)
+        mdns_send_release(egress->entries[sent + i].req);
+      sent += (size_t)ret;
+    }
+  }
+#endif
+  for (size_t i = sent; i < egress->count; i++) {
+    mdns_egress_entry_t *entry = &egress->entries[i];
+    mdns_send_now(egress->handle, &entry->address, entry->req, entry->buf);
+    egress->unbatched++;
+  }
+  egress->datagrams += egress->count;
+  egress->count = 0;
+  egress->handle = NULL;
+}
+
 static const uint8_t mdns_services_query[] = {
     // Query ID
     0x00, 0x00,
@@ -1058,32 +1641,91 @@ static inline void *mdns_answer_add_question_unicast(
 
 static inline void *
 mdns_answer_add_record_header(void *buffer, size_t capacity, void *data,
-                              mdns_record_t record,
+                              const mdns_record_t *record, uint16_t rclass,
+                              uint32_t ttl,
                               mdns_string_table_t *string_table) {
-  data = mdns_string_make(buffer, capacity, data, record.name.str,
-                          record.name.length, string_table);
+  data = mdns_string_make(buffer, capacity, data, record->name.str,
+                          record->name.length, string_table);
   if (!data)
     return 0;
   size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
   if (remain < 10)
     return 0;
 
-  data = mdns_htons(data, record.type);
-  data = mdns_htons(data, record.rclass);
-  data = mdns_htonl(data, record.ttl);
+  data = mdns_htons(data, record->type);
+  data = mdns_htons(data, rclass);
+  data = mdns_htonl(data, ttl);
   data = mdns_htons(data, 0); // Length, to be filled later
   return data;
 }
 
-static inline void *mdns_answer_add_record(void *buffer, size_t capacity,
-                                           void *data, mdns_record_t record,
-                                           mdns_string_table_t *string_table) {
-  // TXT records will be coalesced into one record later
-  if (!data || (record.type == MDNS_RECORDTYPE_TXT))
-    return data;
+static inline size_t mdns_record_rdata_encode(const mdns_record_t *record,
+                                              void *buffer, size_t capacity) {
+  switch (record->type) {
+  case MDNS_RECORDTYPE_A:
+    if (capacity < 4)
+      return 0;
+    memcpy(buffer, &record->data.a.addr.sin_addr.s_addr, 4);
+    return 4;
+
+  case MDNS_RECORDTYPE_AAAA:
+    if (capacity < 16)
+      return 0;
+    memcpy(buffer, &record->data.aaaa.addr.sin6_addr, 16); // ipv6 address
+    return 16;
+
+  case MDNS_RECORDTYPE_TXT: {
+    // A single key=value string, prefixed by its length
+    size_t string_length =
+        record->data.txt.key.length + record->data.txt.value.length + 1;
+    if ((string_length > 255) || (capacity < string_length + 1))
+      return 0;
+    unsigned char *strdata = (unsigned char *)buffer;
+    *strdata++ = (unsigned char)string_length;
+    memcpy(strdata, record->data.txt.key.str, record->data.txt.key.length);
+    strdata += record->data.txt.key.length;
+    *strdata++ = '=';
+    memcpy(strdata, record->data.txt.value.str, record->data.txt.value.length);
+    return string_length + 1;
+  }
+
+  default:
+    return 0;
+  }
+}
+
+static inline size_t mdns_nsec_bitmap_encode(const uint16_t *types,
+                                             size_t count, void *buffer,
+                                             size_t capacity) {
+  // A single window block, numbered 0, with as many bytes as the highest
+  // type needs
+  uint8_t bitmap[32] = {0};
+  size_t length = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (types[i] > 255)
+      return 0;
+    bitmap[types[i] >> 3] |= (uint8_t)(0x80 >> (types[i] & 7));
+    if ((size_t)(types[i] >> 3) + 1 > length)
+      length = (size_t)(types[i] >> 3) + 1;
+  }
+  if (!length || (capacity < length + 2))
+    return 0;
+  uint8_t *data = (uint8_t *)buffer;
+  data[0] = 0;
+  data[1] = (uint8_t)length;
+  memcpy(data + 2, bitmap, length);
+  return length + 2;
+}
+
+static inline void *mdns_record_write(void *buffer, size_t capacity, void *data,
+                                      const mdns_record_t *record,
+                                      uint16_t rclass, uint32_t ttl,
+                                      mdns_string_table_t *string_table) {
+  if (!data)
+    return 0;
 
-  data = mdns_answer_add_record_header(buffer, capacity, data, record,
-                                       string_table);
+  data = mdns_answer_add_record_header(buffer, capacity, data, record, rclass,
+                                       ttl, string_table);
   if (!data)
     return 0;
 
@@ -1092,38 +1734,55 @@ static inline void *mdns_answer_add_record(void *buffer, size_t capacity,
   void *record_data = data;
 
   size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-  switch (record.type) {
-  case MDNS_RECORDTYPE_PTR:
-    data = mdns_string_make(buffer, capacity, data, record.data.ptr.name.str,
-                            record.data.ptr.name.length, string_table);
-    break;
-
-  case MDNS_RECORDTYPE_SRV:
-    if (remain <= 6)
+  if (record->rdata.length) {
+    if (remain < record->rdata.length)
       return 0;
-    data = mdns_htons(data, record.data.srv.priority);
-    data = mdns_htons(data, record.data.srv.weight);
-    data = mdns_htons(data, record.data.srv.port);
-    data = mdns_string_make(buffer, capacity, data, record.data.srv.name.str,
-                            record.data.srv.name.length, string_table);
-    break;
+    memcpy(data, record->rdata.str, record->rdata.length);
+    data = MDNS_POINTER_OFFSET(data, record->rdata.length);
+  } else {
+    switch (record->type) {
+    case MDNS_RECORDTYPE_PTR:
+      data = mdns_string_make(buffer, capacity, data, record->data.ptr.name.str,
+                              record->data.ptr.name.length, string_table);
+      break;
 
-  case MDNS_RECORDTYPE_A:
-    if (remain < 4)
-      return 0;
-    memcpy(data, &record.data.a.addr.sin_addr.s_addr, 4);
-    data = MDNS_POINTER_OFFSET(data, 4);
-    break;
+    case MDNS_RECORDTYPE_SRV:
+      if (remain <= 6)
+        return 0;
+      data = mdns_htons(data, record->data.srv.priority);
+      data = mdns_htons(data, record->data.srv.weight);
+      data = mdns_htons(data, record->data.srv.port);
+      data = mdns_string_make(buffer, capacity, data, record->data.srv.name.str,
+                              record->data.srv.name.length, string_table);
+      break;
 
-  case MDNS_RECORDTYPE_AAAA:
-    if (remain < 16)
-      return 0;
-    memcpy(data, &record.data.aaaa.addr.sin6_addr, 16); // ipv6 address
-    data = MDNS_POINTER_OFFSET(data, 16);
-    break;
+    case MDNS_RECORDTYPE_A:
+    case MDNS_RECORDTYPE_AAAA:
+    case MDNS_RECORDTYPE_TXT: {
+      size_t length = mdns_record_rdata_encode(record, data, remain);
+      if (!length)
+        return 0;
+      data = MDNS_POINTER_OFFSET(data, length);
+      break;
+    }
 
-  default:
-    break;
+    case MDNS_RECORDTYPE_NSEC:
+      data = mdns_string_make(buffer, capacity, data,
+                              record->data.nsec.name.str,
+                              record->data.nsec.name.length, string_table);
+      if (!data)
+        return 0;
+      remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+      if (remain < record->data.nsec.bitmap.length)
+        return 0;
+      memcpy(data, record->data.nsec.bitmap.str,
+             record->data.nsec.bitmap.length);
+      data = MDNS_POINTER_OFFSET(data, record->data.nsec.bitmap.length);
+      break;
+
+    default:
+      break;
+    }
   }
 
   if (!data)
@@ -1134,17 +1793,53 @@ static inline void *mdns_answer_add_record(void *buffer, size_t capacity,
   return data;
 }
 
+// TXT records without pre-encoded RDATA are coalesced into one record by
+// mdns_answer_add_txt_record, and skipped here
+static inline int mdns_record_is_coalesced(const mdns_record_t *record) {
+  return (record->type == MDNS_RECORDTYPE_TXT) && !record->rdata.length;
+}
+
+static inline void *mdns_answer_add_record(void *buffer, size_t capacity,
+                                           void *data,
+                                           const mdns_record_t *record,
+                                           uint16_t rclass, uint32_t ttl,
+                                           mdns_string_table_t *string_table) {
+  if (!data || mdns_record_is_coalesced(record))
+    return data;
+  return mdns_record_write(buffer, capacity, data, record, rclass, ttl,
+                           string_table);
+}
+
+// Class and TTL a record is sent with, given the ones of the message. A
+// record keeps its own unless it has none, except that a TTL of 0 always
+// wins as it marks a goodbye.
+static inline uint16_t mdns_record_rclass(const mdns_record_t *record,
+                                          uint16_t rclass) {
+  if (record->rclass)
+    rclass = record->rclass;
+  rclass &= (uint16_t)(MDNS_CLASS_IN | MDNS_CACHE_FLUSH);
+  // Never flush PTR record
+  if (record->type == MDNS_RECORDTYPE_PTR)
+    rclass &= ~(uint16_t)MDNS_CACHE_FLUSH;
+  return rclass;
+}
+
+static inline uint32_t mdns_record_ttl(const mdns_record_t *record,
+                                       uint32_t ttl) {
+  if (!record->ttl || !ttl)
+    return ttl;
+  return record->ttl;
+}
+
+static inline uint32_t mdns_record_multicast_ttl(const mdns_record_t *record) {
+  return mdns_record_ttl(record, 60);
+}
+
 static inline void mdns_record_update_rclass_ttl(mdns_record_t *record,
                                                  uint16_t rclass,
                                                  uint32_t ttl) {
-  if (!record->rclass)
-    record->rclass = rclass;
-  if (!record->ttl || !ttl)
-    record->ttl = ttl;
-  record->rclass &= (uint16_t)(MDNS_CLASS_IN | MDNS_CACHE_FLUSH);
-  // Never flush PTR record
-  if (record->type == MDNS_RECORDTYPE_PTR)
-    record->rclass &= ~(uint16_t)MDNS_CACHE_FLUSH;
+  record->rclass = mdns_record_rclass(record, rclass);
+  record->ttl = mdns_record_ttl(record, ttl);
 }
 
 static inline void *
@@ -1158,39 +1853,26 @@ mdns_answer_add_txt_record(void *buffer, size_t capacity, void *data,
 
   size_t remain = 0;
   for (size_t irec = 0; data && (irec < record_count); ++irec) {
-    if (records[irec].type != MDNS_RECORDTYPE_TXT)
+    const mdns_record_t *record = &records[irec];
+    if (!mdns_record_is_coalesced(record))
       continue;
 
-    mdns_record_t record = records[irec];
-    mdns_record_update_rclass_ttl(&record, rclass, ttl);
     if (!record_data) {
-      data = mdns_answer_add_record_header(buffer, capacity, data, record,
-                                           string_table);
+      data = mdns_answer_add_record_header(
+          buffer, capacity, data, record, mdns_record_rclass(record, rclass),
+          mdns_record_ttl(record, ttl), string_table);
       if (!data)
         return data;
       record_length = MDNS_POINTER_OFFSET(data, -2);
       record_data = data;
     }
 
-    // TXT strings are unlikely to be shared, just make then raw. Also need one
-    // byte for termination, thus the <= check
-    size_t string_length =
-        record.data.txt.key.length + record.data.txt.value.length + 1;
-    if (!data)
-      return 0;
+    // TXT strings are unlikely to be shared, just make then raw
     remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-    if ((remain <= string_length) || (string_length > 0x3FFF))
+    size_t length = mdns_record_rdata_encode(record, data, remain);
+    if (!length)
       return 0;
-
-    unsigned char *strdata = (unsigned char *)data;
-    *strdata++ = (unsigned char)string_length;
-    memcpy(strdata, record.data.txt.key.str, record.data.txt.key.length);
-    strdata += record.data.txt.key.length;
-    *strdata++ = '=';
-    memcpy(strdata, record.data.txt.value.str, record.data.txt.value.length);
-    strdata += record.data.txt.value.length;
-
-    data = strdata;
+    data = MDNS_POINTER_OFFSET(data, length);
   }
 
   // Fill record length
@@ -1207,7 +1889,7 @@ mdns_answer_get_record_count(const mdns_record_t *records,
   uint16_t total_count = 0;
   uint16_t txt_record = 0;
   for (size_t irec = 0; irec < record_count; ++irec) {
-    if (records[irec].type == MDNS_RECORDTYPE_TXT)
+    if (mdns_record_is_coalesced(&records[irec]))
       txt_record = 1;
     else
       ++total_count;
@@ -1215,14 +1897,14 @@ mdns_answer_get_record_count(const mdns_record_t *records,
   return total_count + txt_record;
 }
 
-static inline int mdns_query_answer_unicast(
-    uv_udp_t *handle, const void *address, size_t address_size, void *buffer,
-    size_t capacity, uint16_t query_id, mdns_record_type_t record_type,
-    const char *name, size_t name_length, mdns_record_t answer,
-    const mdns_record_t *authority, size_t authority_count,
-    const mdns_record_t *additional, size_t additional_count) {
+static inline size_t mdns_query_answer_unicast_write(
+    void *buffer, size_t capacity, uint16_t query_id,
+    mdns_record_type_t record_type, const char *name, size_t name_length,
+    const mdns_record_t *answer, const mdns_record_t *authority,
+    size_t authority_count, const mdns_record_t *additional,
+    size_t additional_count) {
   if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
-    return -1;
+    return 0;
 
   // According to RFC 6762:
   // The cache-flush bit MUST NOT be set in any resource records in a response
@@ -1241,7 +1923,8 @@ static inline int mdns_query_answer_unicast(
   header->additional_rrs =
       htons(mdns_answer_get_record_count(additional, additional_count));
 
-  mdns_string_table_t string_table = {{0}, 0, 0};
+  mdns_string_table_t string_table;
+  mdns_string_table_reset(&string_table);
   void *data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
 
   // Fill in question
@@ -1249,18 +1932,15 @@ static inline int mdns_query_answer_unicast(
                                           name, name_length, &string_table);
 
   // Fill in answer
-  answer.rclass = rclass;
-  answer.ttl = ttl;
-  data = mdns_answer_add_record(buffer, capacity, data, answer, &string_table);
+  data = mdns_answer_add_record(buffer, capacity, data, answer, rclass, ttl,
+                                &string_table);
 
   // Fill in authority records
   for (size_t irec = 0; data && (irec < authority_count); ++irec) {
-    mdns_record_t record = authority[irec];
-    record.rclass = rclass;
-    if (!record.ttl)
-      record.ttl = ttl;
-    data =
-        mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+    const mdns_record_t *record = &authority[irec];
+    data = mdns_answer_add_record(buffer, capacity, data, record, rclass,
+                                  record->ttl ? record->ttl : ttl,
+                                  &string_table);
   }
   data =
       mdns_answer_add_txt_record(buffer, capacity, data, authority,
@@ -1268,30 +1948,41 @@ static inline int mdns_query_answer_unicast(
 
   // Fill in additional records
   for (size_t irec = 0; data && (irec < additional_count); ++irec) {
-    mdns_record_t record = additional[irec];
-    record.rclass = rclass;
-    if (!record.ttl)
-      record.ttl = ttl;
-    data =
-        mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+    const mdns_record_t *record = &additional[irec];
+    data = mdns_answer_add_record(buffer, capacity, data, record, rclass,
+                                  record->ttl ? record->ttl : ttl,
+                                  &string_table);
   }
   data =
       mdns_answer_add_txt_record(buffer, capacity, data, additional,
                                  additional_count, rclass, ttl, &string_table);
   if (!data)
-    return -1;
+    return 0;
+
+  return MDNS_POINTER_DIFF(data, buffer);
+}
 
-  size_t tosend = MDNS_POINTER_DIFF(data, buffer);
+static inline int mdns_query_answer_unicast(
+    uv_udp_t *handle, const void *address, size_t address_size, void *buffer,
+    size_t capacity, uint16_t query_id, mdns_record_type_t record_type,
+    const char *name, size_t name_length, mdns_record_t answer,
+    const mdns_record_t *authority, size_t authority_count,
+    const mdns_record_t *additional, size_t additional_count) {
+  size_t tosend = mdns_query_answer_unicast_write(
+      buffer, capacity, query_id, record_type, name, name_length, &answer,
+      authority, authority_count, additional, additional_count);
+  if (!tosend)
+    return -1;
   return mdns_unicast_send(handle, address, address_size, buffer, tosend);
 }
 
-static inline int mdns_answer_multicast_rclass_ttl(
-    uv_udp_t *handle, void *buffer, size_t capacity, mdns_record_t answer,
+static inline size_t mdns_answer_multicast_rclass_ttl_write(
+    void *buffer, size_t capacity, const mdns_record_t *answer,
     const mdns_record_t *authority, size_t authority_count,
     const mdns_record_t *additional, size_t additional_count, uint16_t rclass,
     uint32_t ttl) {
   if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
-    return -1;
+    return 0;
 
   // Basic answer structure
   struct mdns_header_t *header = (struct mdns_header_t *)buffer;
@@ -1304,20 +1995,21 @@ static inline int mdns_answer_multicast_rclass_ttl(
   header->additional_rrs =
       htons(mdns_answer_get_record_count(additional, additional_count));
 
-  mdns_string_table_t string_table = {{0}, 0, 0};
+  mdns_string_table_t string_table;
+  mdns_string_table_reset(&string_table);
   void *data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
 
   // Fill in answer
-  mdns_record_t record = answer;
-  mdns_record_update_rclass_ttl(&record, rclass, ttl);
-  data = mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+  data = mdns_answer_add_record(
+      buffer, capacity, data, answer, mdns_record_rclass(answer, rclass),
+      mdns_record_ttl(answer, ttl), &string_table);
 
   // Fill in authority records
   for (size_t irec = 0; data && (irec < authority_count); ++irec) {
-    record = authority[irec];
-    mdns_record_update_rclass_ttl(&record, rclass, ttl);
-    data =
-        mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+    const mdns_record_t *record = &authority[irec];
+    data = mdns_answer_add_record(
+        buffer, capacity, data, record, mdns_record_rclass(record, rclass),
+        mdns_record_ttl(record, ttl), &string_table);
   }
   data =
       mdns_answer_add_txt_record(buffer, capacity, data, authority,
@@ -1325,21 +2017,103 @@ static inline int mdns_answer_multicast_rclass_ttl(
 
   // Fill in additional records
   for (size_t irec = 0; data && (irec < additional_count); ++irec) {
-    record = additional[irec];
-    mdns_record_update_rclass_ttl(&record, rclass, ttl);
-    data =
-        mdns_answer_add_record(buffer, capacity, data, record, &string_table);
+    const mdns_record_t *record = &additional[irec];
+    data = mdns_answer_add_record(
+        buffer, capacity, data, record, mdns_record_rclass(record, rclass),
+        mdns_record_ttl(record, ttl), &string_table);
   }
   data =
       mdns_answer_add_txt_record(buffer, capacity, data, additional,
                                  additional_count, rclass, ttl, &string_table);
   if (!data)
-    return -1;
+    return 0;
+
+  return MDNS_POINTER_DIFF(data, buffer);
+}
 
-  size_t tosend = MDNS_POINTER_DIFF(data, buffer);
+static inline int mdns_answer_multicast_rclass_ttl(
+    uv_udp_t *handle, void *buffer, size_t capacity, mdns_record_t answer,
+    const mdns_record_t *authority, size_t authority_count,
+    const mdns_record_t *additional, size_t additional_count, uint16_t rclass,
+    uint32_t ttl) {
+  size_t tosend = mdns_answer_multicast_rclass_ttl_write(
+      buffer, capacity, &answer, authority, authority_count, additional,
+      additional_count, rclass, ttl);
+  if (!tosend)
+    return -1;
   return uvmdns_multicast_send(handle, buffer, tosend);
 }
 
+static inline int mdns_answer_send(uv_udp_t *handle, const void *address,
+                                   size_t address_size, const void *buffer,
+                                   size_t size, uint16_t query_id) {
+  if (size < sizeof(struct mdns_header_t))
+    return -1;
+
+  uv_udp_send_t *send_req;
+  uv_buf_t send_buf = mdns_send_alloc(&send_req, buffer, size);
+  if (!send_buf.base)
+    return -1;
+  mdns_htons(send_buf.base, query_id);
+  return mdns_send_queue(handle, address, address_size, send_req, send_buf);
+}
+
+static inline int mdns_answer_send_question(uv_udp_t *handle,
+                                            const void *address,
+                                            size_t address_size,
+                                            const void *buffer, size_t size,
+                                            uint16_t query_id,
+                                            const void *question,
+                                            size_t question_size) {
+  struct mdns_header_t header;
+  if (!uvmdns_header_parse(buffer, size, &header))
+    return -1;
+
+  uv_udp_send_t *send_req;
+  uv_buf_t send_buf = mdns_send_alloc(&send_req, buffer, size);
+  if (!send_buf.base)
+    return -1;
+  mdns_htons(send_buf.base, query_id);
+
+  // Compression pointers in the records may point into the question, so it
+  // can only be swapped for one taking up exactly the same bytes
+  size_t offset = sizeof(struct mdns_header_t);
+  if ((header.questions == 1) && mdns_string_skip(buffer, size, &offset) &&
+      ((offset + 4 - sizeof(struct mdns_header_t)) == question_size) &&
+      ((offset + 4) <= size))
+    memcpy(send_buf.base + sizeof(struct mdns_header_t), question,
+           question_size);
+  return mdns_send_queue(handle, address, address_size, send_req, send_buf);
+}
+
+static inline uint32_t mdns_answer_ttl(const void *buffer, size_t size) {
+  struct mdns_header_t header;
+  if (!uvmdns_header_parse(buffer, size, &header) || !header.answer_rrs)
+    return 0;
+
+  size_t offset = sizeof(struct mdns_header_t);
+  for (uint16_t i = 0; i < header.questions; ++i) {
+    if (!mdns_string_skip(buffer, size, &offset) || ((offset + 4) > size))
+      return 0;
+    offset += 4;
+  }
+
+  uint32_t lowest = 0xFFFFFFFFU;
+  for (uint16_t i = 0; i < header.answer_rrs; ++i) {
+    if (!mdns_string_skip(buffer, size, &offset) || ((offset + 10) > size))
+      return 0;
+    uint32_t ttl = mdns_ntohl(MDNS_POINTER_OFFSET_CONST(buffer, offset + 4));
+    uint16_t length =
+        mdns_ntohs(MDNS_POINTER_OFFSET_CONST(buffer, offset + 8));
+    offset += 10 + length;
+    if (offset > size)
+      return 0;
+    if (ttl < lowest)
+      lowest = ttl;
+  }
+  return lowest;
+}
+
 static inline int mdns_query_answer_multicast(
     uv_udp_t *handle, void *buffer, size_t capacity, mdns_record_t answer,
     const mdns_record_t *authority, size_t authority_count,
@@ -1372,6 +2146,159 @@ static inline int mdns_goodbye_multicast(uv_udp_t *handle, void *buffer,
       additional_count, MDNS_CLASS_IN, 0);
 }
 
+static inline void mdns_packet_builder_init(
+    mdns_packet_builder_t *builder, uv_udp_t *handle, const void *address,
+    size_t address_size, void *buffer, size_t capacity, uint16_t query_id,
+    const mdns_query_t *questions, size_t question_count) {
+  memset(builder, 0, sizeof(mdns_packet_builder_t));
+  builder->handle = handle;
+  builder->address = address;
+  builder->address_size = address_size;
+  builder->buffer = buffer;
+  builder->capacity = capacity;
+  builder->query_id = query_id;
+  builder->questions = questions;
+  builder->question_count = address ? question_count : 0;
+  builder->section = MDNS_ENTRYTYPE_ANSWER;
+}
+
+static inline int mdns_packet_builder_start(mdns_packet_builder_t *builder) {
+  void *buffer = builder->buffer;
+  size_t capacity = builder->capacity;
+  if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+    return -1;
+
+  struct mdns_header_t *header = (struct mdns_header_t *)buffer;
+  header->query_id = builder->address ? htons(builder->query_id) : 0;
+  header->flags = htons(0x8400);
+  header->questions = htons((uint16_t)builder->question_count);
+  header->answer_rrs = 0;
+  header->authority_rrs = 0;
+  header->additional_rrs = 0;
+
+  mdns_string_table_reset(&builder->string_table);
+  void *data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
+  for (size_t iquestion = 0; iquestion < builder->question_count;
+       ++iquestion) {
+    const mdns_query_t *question = &builder->questions[iquestion];
+    data = mdns_answer_add_question_unicast(buffer, capacity, data,
+                                            question->type, question->name,
+                                            question->length,
+                                            &builder->string_table);
+    if (!data)
+      return -1;
+  }
+  builder->data = data;
+  builder->answer_rrs = 0;
+  builder->additional_rrs = 0;
+  return 0;
+}
+
+static inline size_t mdns_packet_builder_close(mdns_packet_builder_t *builder) {
+  if (!builder->data || (!builder->answer_rrs && !builder->additional_rrs))
+    return 0;
+  struct mdns_header_t *header = (struct mdns_header_t *)builder->buffer;
+  header->answer_rrs = htons(builder->answer_rrs);
+  header->additional_rrs = htons(builder->additional_rrs);
+  return MDNS_POINTER_DIFF(builder->data, builder->buffer);
+}
+
+static inline int mdns_packet_builder_send(mdns_packet_builder_t *builder) {
+  size_t tosend = mdns_packet_builder_close(builder);
+  builder->data = 0;
+  builder->packets++;
+  if (builder->address)
+    return mdns_unicast_send(builder->handle, builder->address,
+                             builder->address_size, builder->buffer, tosend);
+  return uvmdns_multicast_send(builder->handle, builder->buffer, tosend);
+}
+
+static inline void *mdns_packet_builder_write(mdns_packet_builder_t *builder,
+                                              const mdns_record_t *record,
+                                              int answer) {
+  uint16_t rclass;
+  uint32_t ttl;
+  if (builder->rclass) {
+    rclass = mdns_record_rclass(record, builder->rclass);
+    ttl = mdns_record_ttl(record, builder->ttl);
+  } else if (builder->address) {
+    // Same as mdns_query_answer_unicast, which has no cache-flush bit
+    rclass = MDNS_CLASS_IN;
+    ttl = (answer || !record->ttl) ? 10 : record->ttl;
+  } else {
+    rclass = mdns_record_rclass(record, MDNS_CLASS_IN);
+    ttl = mdns_record_multicast_ttl(record);
+  }
+  return mdns_record_write(builder->buffer, builder->capacity, builder->data,
+                           record, rclass, ttl, &builder->string_table);
+}
+
+static inline int mdns_packet_builder_add(mdns_packet_builder_t *builder,
+                                          const mdns_record_t *record,
+                                          mdns_entry_type_t section) {
+  if ((section != MDNS_ENTRYTYPE_ANSWER) &&
+      (section != MDNS_ENTRYTYPE_ADDITIONAL))
+    return -1;
+  if (section < builder->section)
+    return -1;
+  builder->section = section;
+  int answer = (section == MDNS_ENTRYTYPE_ANSWER);
+
+  if (!builder->data && (mdns_packet_builder_start(builder) < 0))
+    return -1;
+
+  // Once a record does not fit the packet is closed at the end of the
+  // previous record, so names of the failed record are never referenced
+  void *next = mdns_packet_builder_write(builder, record, answer);
+  if (!next) {
+    // A single record larger than the packet can never be sent, and without
+    // a handle there is only the one packet
+    if ((!builder->answer_rrs && !builder->additional_rrs) || !builder->handle)
+      return -1;
+    if (mdns_packet_builder_send(builder) < 0)
+      return -1;
+    if (mdns_packet_builder_start(builder) < 0)
+      return -1;
+    next = mdns_packet_builder_write(builder, record, answer);
+    if (!next)
+      return -1;
+  }
+  builder->data = next;
+  if (answer)
+    ++builder->answer_rrs;
+  else
+    ++builder->additional_rrs;
+  return 0;
+}
+
+static inline int mdns_packet_builder_finish(mdns_packet_builder_t *builder) {
+  if (!builder->data || (!builder->answer_rrs && !builder->additional_rrs))
+    return 0;
+  return mdns_packet_builder_send(builder);
+}
+
+static inline int mdns_answer_records(
+    uv_udp_t *handle, const void *address, size_t address_size, void *buffer,
+    size_t capacity, uint16_t query_id, const mdns_query_t *questions,
+    size_t question_count, const mdns_record_t *const *answers,
+    size_t answer_count, const mdns_record_t *const *additional,
+    size_t additional_count) {
+  mdns_packet_builder_t builder;
+  mdns_packet_builder_init(&builder, handle, address, address_size, buffer,
+                           capacity, query_id, questions, question_count);
+  for (size_t irec = 0; irec < answer_count; ++irec) {
+    if (mdns_packet_builder_add(&builder, answers[irec],
+                                MDNS_ENTRYTYPE_ANSWER) < 0)
+      return -1;
+  }
+  for (size_t irec = 0; irec < additional_count; ++irec) {
+    if (mdns_packet_builder_add(&builder, additional[irec],
+                                MDNS_ENTRYTYPE_ADDITIONAL) < 0)
+      return -1;
+  }
+  return mdns_packet_builder_finish(&builder);
+}
+
 static inline mdns_string_t
 mdns_record_parse_ptr(const void *buffer, size_t size, size_t offset,
                       size_t length, char *strbuffer, size_t capacity) {
@@ -1567,6 +2494,258 @@ static inline size_t uvmdns_socket_recv(const uv_buf_t *buf,
   return total_records;
 }
 
+static inline void mdns_label_table_reset(mdns_label_table_t *table) {
+  table->count = 0;
+  memset(table->slot_offset, 0, sizeof(table->slot_offset));
+}
+
+static inline size_t mdns_label_table_slot(const mdns_label_table_t *table,
+                                           size_t offset) {
+  size_t slot = (offset * 2654435761U) & (MDNS_LABEL_TABLE_SLOTS - 1);
+  while (table->slot_offset[slot] && (table->slot_offset[slot] != offset))
+    slot = (slot + 1) & (MDNS_LABEL_TABLE_SLOTS - 1);
+  return slot;
+}
+
+static inline int mdns_label_table_add(mdns_label_table_t *table,
+                                       const void *buffer, size_t size,
+                                       size_t *offset, uint16_t *label) {
+  const uint8_t *data = (const uint8_t *)buffer;
+  // Labels created for this name are unfinished until the name ends, reaching
+  // one of them again through a pointer means the name loops
+  size_t first_new = table->count;
+  uint16_t first = MDNS_LABEL_NONE;
+  uint16_t *link = &first;
+  size_t cur = *offset;
+  size_t end = MDNS_INVALID_POS;
+  unsigned int counter = 0;
+
+  while (1) {
+    if ((cur >= size) || (cur > 0xFFFF) || (counter++ > MDNS_MAX_SUBSTRINGS))
+      return 0;
+
+    size_t slot = mdns_label_table_slot(table, cur);
+    if (table->slot_offset[slot]) {
+      uint16_t known = table->slot_label[slot];
+      if (known >= first_new)
+        return 0;
+      *link = known;
+      if (end == MDNS_INVALID_POS) {
+        // The rest of the name was decoded and bounds checked before, only
+        // find where it ends in place
+        while (data[cur] && !mdns_is_string_ref(data[cur]))
+          cur += 1 + (size_t)data[cur];
+        end = cur + (data[cur] ? 2 : 1);
+      }
+      break;
+    }
+
+    if (mdns_is_string_ref(data[cur])) {
+      if (size < cur + 2)
+        return 0;
+      if (end == MDNS_INVALID_POS)
+        end = cur + 2;
+      cur = mdns_ntohs(MDNS_POINTER_OFFSET_CONST(buffer, cur)) & 0x3fff;
+      continue;
+    }
+
+    size_t length = data[cur];
+    if (!length) {
+      *link = MDNS_LABEL_NONE;
+      if (end == MDNS_INVALID_POS)
+        end = cur + 1;
+      break;
+    }
+    if ((length > 63) || (size < cur + 1 + length) ||
+        (table->count >= MDNS_LABEL_TABLE_CAPACITY))
+      return 0;
+
+    uint16_t index = (uint16_t)table->count++;
+    table->labels[index].offset = (uint16_t)(cur + 1);
+    table->labels[index].length = (uint8_t)length;
+    table->labels[index].next = MDNS_LABEL_NONE;
+    table->slot_offset[slot] = (uint16_t)cur;
+    table->slot_label[slot] = index;
+    *link = index;
+    link = &table->labels[index].next;
+    cur += 1 + length;
+  }
+
+  *offset = end;
+  *label = first;
+  return 1;
+}
+
+static inline uint32_t mdns_label_table_hash(const mdns_label_table_t *table,
+                                             const void *buffer,
+                                             uint16_t label) {
+  uint32_t hash = MDNS_HASH_INIT;
+  for (uint16_t cur = label; cur != MDNS_LABEL_NONE;
+       cur = table->labels[cur].next) {
+    if (cur != label)
+      hash = mdns_hash_update(hash, ".", 1);
+    hash = mdns_hash_update(
+        hash, MDNS_POINTER_OFFSET_CONST(buffer, table->labels[cur].offset),
+        table->labels[cur].length);
+  }
+  return hash;
+}
+
+static inline int mdns_label_table_equal(const mdns_label_table_t *table,
+                                         const void *buffer, uint16_t label,
+                                         const void *name, size_t length) {
+  const uint8_t *wire = (const uint8_t *)name;
+  size_t pos = 0;
+  for (uint16_t cur = label; cur != MDNS_LABEL_NONE;
+       cur = table->labels[cur].next) {
+    const mdns_label_t *entry = &table->labels[cur];
+    if ((pos >= length) || (wire[pos] != entry->length) ||
+        (length < pos + 1 + entry->length))
+      return 0;
+    if (strncasecmp((const char *)MDNS_POINTER_OFFSET_CONST(buffer,
+                                                            entry->offset),
+                    (const char *)wire + pos + 1, entry->length))
+      return 0;
+    pos += 1 + entry->length;
+  }
+  return (pos < length) && !wire[pos];
+}
+
+static inline mdns_string_t
+mdns_label_table_extract(const mdns_label_table_t *table, const void *buffer,
+                         uint16_t label, char *str, size_t capacity) {
+  size_t remain = capacity;
+  char *dst = str;
+  for (uint16_t cur = label; (cur != MDNS_LABEL_NONE) && remain;
+       cur = table->labels[cur].next) {
+    const mdns_label_t *entry = &table->labels[cur];
+    size_t to_copy = (entry->length < remain) ? entry->length : remain;
+    memcpy(dst, MDNS_POINTER_OFFSET_CONST(buffer, entry->offset), to_copy);
+    dst += to_copy;
+    remain -= to_copy;
+    if (remain) {
+      *dst++ = '.';
+      --remain;
+    }
+  }
+  mdns_string_t result = {str, capacity - remain};
+  return result;
+}
+
+static inline int uvmdns_header_parse(const void *buffer, size_t size,
+                                      struct mdns_header_t *header) {
+  if (size < sizeof(struct mdns_header_t))
+    return 0;
+
+  const uint16_t *data = (const uint16_t *)buffer;
+  header->query_id = mdns_ntohs(data++);
+  header->flags = mdns_ntohs(data++);
+  header->questions = mdns_ntohs(data++);
+  header->answer_rrs = mdns_ntohs(data++);
+  header->authority_rrs = mdns_ntohs(data++);
+  header->additional_rrs = mdns_ntohs(data++);
+  return 1;
+}
+
+static inline size_t uvmdns_questions_parse(const void *buffer, size_t size,
+                                            const struct mdns_header_t *header,
+                                            mdns_label_table_t *table,
+                                            mdns_question_t *questions,
+                                            size_t capacity) {
+  mdns_label_table_reset(table);
+
+  size_t count = 0;
+  size_t offset = sizeof(struct mdns_header_t);
+  for (int iquestion = 0;
+       (iquestion < header->questions) && (count < capacity); ++iquestion) {
+    size_t question_offset = offset;
+    uint16_t label;
+    if (!mdns_label_table_add(table, buffer, size, &offset, &label))
+      break;
+    int dns_sd = mdns_label_table_equal(
+        table, buffer, label,
+        MDNS_POINTER_OFFSET_CONST(mdns_services_query,
+                                  sizeof(struct mdns_header_t)),
+        sizeof(mdns_services_query) - sizeof(struct mdns_header_t) - 4);
+    if ((offset + 4) > size)
+      break;
+    size_t length = offset - question_offset;
+    const uint16_t *data =
+        (const uint16_t *)MDNS_POINTER_OFFSET_CONST(buffer, offset);
+    offset += 4;
+
+    uint16_t rtype = mdns_ntohs(data++);
+    uint16_t rclass = mdns_ntohs(data++);
+    uint16_t class_without_flushbit = rclass & ~MDNS_CACHE_FLUSH;
+
+    // Make sure we get a question of class IN or ANY
+    if (!((class_without_flushbit == MDNS_CLASS_IN) ||
+          (class_without_flushbit == MDNS_CLASS_ANY))) {
+      break;
+    }
+
+    if (dns_sd && header->flags)
+      continue;
+
+    questions[count].name_offset = question_offset;
+    questions[count].name_length = length;
+    questions[count].name_label = label;
+    questions[count].rtype = rtype;
+    questions[count].rclass = rclass;
+    ++count;
+  }
+
+  return count;
+}
+
+static inline size_t
+uvmdns_known_answers_parse(const void *buffer, size_t size,
+                           const struct mdns_header_t *header,
+                           mdns_label_table_t *table,
+                           mdns_known_answer_t *answers, size_t capacity) {
+  size_t offset = sizeof(struct mdns_header_t);
+  for (int iquestion = 0; iquestion < header->questions; ++iquestion) {
+    if (!mdns_string_skip(buffer, size, &offset) || ((offset + 4) > size))
+      return 0;
+    offset += 4;
+  }
+
+  size_t count = 0;
+  for (int ianswer = 0; (ianswer < header->answer_rrs) && (count < capacity);
+       ++ianswer) {
+    mdns_known_answer_t *answer = &answers[count];
+    if (!mdns_label_table_add(table, buffer, size, &offset,
+                              &answer->name_label) ||
+        ((offset + 10) > size))
+      break;
+    const uint16_t *data =
+        (const uint16_t *)MDNS_POINTER_OFFSET_CONST(buffer, offset);
+    answer->rtype = mdns_ntohs(data++);
+    answer->rclass = mdns_ntohs(data++);
+    answer->ttl = mdns_ntohl(data);
+    data += 2;
+    answer->rdata_length = mdns_ntohs(data++);
+    answer->rdata_offset = offset + 10;
+    offset = answer->rdata_offset + answer->rdata_length;
+    if (offset > size)
+      break;
+
+    answer->rdata_label = MDNS_LABEL_NONE;
+    size_t name_offset = answer->rdata_offset;
+    if (answer->rtype == MDNS_RECORDTYPE_SRV)
+      name_offset += 6;
+    if ((answer->rtype == MDNS_RECORDTYPE_PTR) ||
+        ((answer->rtype == MDNS_RECORDTYPE_SRV) &&
+         (answer->rdata_length > 6))) {
+      if (!mdns_label_table_add(table, buffer, size, &name_offset,
+                                &answer->rdata_label))
+        break;
+    }
+    ++count;
+  }
+  return count;
+}
+
 #ifdef _WIN32
 #undef strncasecmp
 #endif
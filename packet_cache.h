@@ -0,0 +1,224 @@
+#pragma once
+#include "mdns.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Distinct query packets remembered, the least recently used is replaced
+#define PACKET_CACHE_ENTRIES 64
+// Queries answered with more packets than this are not cached
+#define PACKET_CACHE_RESPONSES 8
+// Queries multicasting more records than this are not cached
+#define PACKET_CACHE_SLOTS 32
+// Queries larger than this are not cached
+#define PACKET_CACHE_QUERY_SIZE 512
+// Milliseconds an entry is replayed for. A service's records never change
+// while it is in the table, so a replay is byte for byte what answering the
+// query again would send, whatever the TTLs in it. Entries expire anyway so
+// the answers to one-off queries do not linger.
+#define PACKET_CACHE_LIFETIME 10000
+
+// An answer sent for a query, unicast to the sender or multicast
+typedef struct {
+  bool unicast;
+  size_t size;
+  char data[];
+} packet_response_t;
+
+typedef struct {
+  // Hash of the query bytes, checked before comparing the bytes themselves
+  uint32_t hash;
+  // Size of the query, 0 if the entry is empty
+  size_t size;
+  char query[PACKET_CACHE_QUERY_SIZE];
+  packet_response_t *responses[PACKET_CACHE_RESPONSES];
+  size_t responses_count;
+  // Slots of the records multicast, rate limited on replay
+  uint32_t slots[PACKET_CACHE_SLOTS];
+  size_t slots_count;
+  // Set when the query produced more answers than fit the entry
+  bool overflow;
+  // Loop times in milliseconds
+  uint64_t expires;
+  uint64_t used;
+} packet_cache_entry_t;
+
+// Answers sent for recently seen query packets, keyed by the exact bytes of
+// the query. Clients repeat identical queries, which are then answered by
+// sending the same packets again without parsing the query.
+typedef struct {
+  packet_cache_entry_t entries[PACKET_CACHE_ENTRIES];
+  // The answers to the current query are recorded apart, and only take the
+  // place of an entry once committed
+  packet_cache_entry_t staging;
+  packet_cache_entry_t *recording;
+  size_t recording_size;
+  uint64_t hits;
+  uint64_t misses;
+} packet_cache_t;
+
+const packet_cache_entry_t *packet_cache_find(packet_cache_t *cache,
+                                              const void *query, size_t size,
+                                              uint64_t now);
+
+void packet_cache_begin(packet_cache_t *cache, const void *query, size_t size,
+                        uint64_t now);
+
+void packet_cache_record(packet_cache_t *cache, bool unicast,
+                         const void *data, size_t size);
+
+void packet_cache_record_slot(packet_cache_t *cache, uint32_t slot);
+
+void packet_cache_commit(packet_cache_t *cache, uint64_t now);
+
+void packet_cache_cancel(packet_cache_t *cache);
+
+void packet_cache_clear(packet_cache_t *cache);
+
+static void packet_cache_entry_clear(packet_cache_entry_t *entry) {
+  for (size_t i = 0; i < entry->responses_count; i++)
+    free(entry->responses[i]);
+  entry->responses_count = 0;
+  entry->slots_count = 0;
+  entry->size = 0;
+  entry->overflow = false;
+  entry->expires = 0;
+}
+
+const packet_cache_entry_t *packet_cache_find(packet_cache_t *cache,
+                                              const void *query, size_t size,
+                                              uint64_t now) {
+  if (size > PACKET_CACHE_QUERY_SIZE)
+    return NULL;
+  uint32_t hash = mdns_hash_update(MDNS_HASH_INIT, query, size);
+  for (int i = 0; i < PACKET_CACHE_ENTRIES; i++) {
+    packet_cache_entry_t *entry = &cache->entries[i];
+    if (!entry->size || (entry->hash != hash) || (entry->size != size) ||
+        memcmp(entry->query, query, size))
+      continue;
+    if (entry->expires <= now) {
+      packet_cache_entry_clear(entry);
+      break;
+    }
+    entry->used = now;
+    cache->hits++;
+    return entry;
+  }
+  cache->misses++;
+  return NULL;
+}
+
+void packet_cache_begin(packet_cache_t *cache, const void *query, size_t size,
+                        uint64_t now) {
+  cache->recording = NULL;
+  if (size > PACKET_CACHE_QUERY_SIZE)
+    return;
+
+  packet_cache_entry_t *entry = &cache->staging;
+  packet_cache_entry_clear(entry);
+  entry->hash = mdns_hash_update(MDNS_HASH_INIT, query, size);
+  memcpy(entry->query, query, size);
+  entry->used = now;
+  cache->recording = entry;
+  cache->recording_size = size;
+}
+
+void packet_cache_record(packet_cache_t *cache, bool unicast,
+                         const void *data, size_t size) {
+  packet_cache_entry_t *entry = cache->recording;
+  if (!entry || entry->overflow)
+    return;
+  if (entry->responses_count == PACKET_CACHE_RESPONSES) {
+    entry->overflow = true;
+    return;
+  }
+  packet_response_t *response = malloc(sizeof(packet_response_t) + size);
+  if (!response) {
+    entry->overflow = true;
+    return;
+  }
+  response->unicast = unicast;
+  response->size = size;
+  memcpy(response->data, data, size);
+  entry->responses[entry->responses_count++] = response;
+}
+
+// Note a record multicast in the answers to the current query
+void packet_cache_record_slot(packet_cache_t *cache, uint32_t slot) {
+  packet_cache_entry_t *entry = cache->recording;
+  if (!entry || entry->overflow)
+    return;
+  if (entry->slots_count == PACKET_CACHE_SLOTS) {
+    entry->overflow = true;
+    return;
+  }
+  entry->slots[entry->slots_count++] = slot;
+}
+
+void packet_cache_commit(packet_cache_t *cache, uint64_t now) {
+  packet_cache_entry_t *staging = cache->recording;
+  cache->recording = NULL;
+  if (!staging)
+    return;
+
+  // Nothing sent, or records with a TTL of 0 which are never replayed
+  uint32_t ttl = 0;
+  for (size_t i = 0; i < staging->responses_count; i++) {
+    const packet_response_t *response = staging->responses[i];
+    uint32_t response_ttl = mdns_answer_ttl(response->data, response->size);
+    if (!i || (response_ttl < ttl))
+      ttl = response_ttl;
+  }
+  if (staging->overflow || !ttl) {
+    packet_cache_entry_clear(staging);
+    return;
+  }
+
+  // Replace an entry for the same query, or else take an empty entry or the
+  // one used least recently
+  size_t size = cache->recording_size;
+  packet_cache_entry_t *entry = NULL;
+  for (int i = 0; i < PACKET_CACHE_ENTRIES && !entry; i++) {
+    packet_cache_entry_t *candidate = &cache->entries[i];
+    if (candidate->size && (candidate->hash == staging->hash) &&
+        (candidate->size == size) &&
+        !memcmp(candidate->query, staging->query, size))
+      entry = candidate;
+  }
+  for (int i = 0; i < PACKET_CACHE_ENTRIES && !entry; i++) {
+    packet_cache_entry_t *candidate = &cache->entries[i];
+    if (!candidate->size)
+      entry = candidate;
+  }
+  if (!entry) {
+    entry = &cache->entries[0];
+    for (int i = 1; i < PACKET_CACHE_ENTRIES; i++) {
+      if (cache->entries[i].used < entry->used)
+        entry = &cache->entries[i];
+    }
+  }
+  packet_cache_entry_clear(entry);
+
+  // The entry takes over the recorded answers
+  *entry = *staging;
+  staging->responses_count = 0;
+  entry->expires = now + PACKET_CACHE_LIFETIME;
+  // A size marks the entry as in use, so it is only set once complete
+  entry->size = size;
+}
+
+// Keep the answers to the current query out of the cache, for a query with
+// answers that are sent later
+void packet_cache_cancel(packet_cache_t *cache) {
+  if (cache->recording)
+    cache->recording->overflow = true;
+}
+
+void packet_cache_clear(packet_cache_t *cache) {
+  for (int i = 0; i < PACKET_CACHE_ENTRIES; i++)
+    packet_cache_entry_clear(&cache->entries[i]);
+  packet_cache_entry_clear(&cache->staging);
+  cache->recording = NULL;
+}
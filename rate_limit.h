@@ -0,0 +1,75 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Shortest time between two multicasts of the same record, and when
+// defending a record against a probe, in milliseconds (RFC 6762 section 6)
+#define RATE_LIMIT_INTERVAL 1000
+#define RATE_LIMIT_INTERVAL_PROBE 250
+
+// When each record was last multicast, one loop time per record indexed by
+// the slot of the record
+typedef struct {
+  uint64_t *last;
+  size_t count;
+  // Records multicast, and the ones left out as multicast too recently
+  uint64_t allowed;
+  uint64_t dropped;
+} rate_limit_t;
+
+int rate_limit_init(rate_limit_t *limit, size_t count);
+
+bool rate_limit_ready(const rate_limit_t *limit, size_t slot, uint64_t now,
+                      uint64_t interval);
+
+bool rate_limit_allow(rate_limit_t *limit, size_t slot, uint64_t now,
+                      uint64_t interval);
+
+void rate_limit_stamp(rate_limit_t *limit, size_t slot, uint64_t now);
+
+void rate_limit_free(rate_limit_t *limit);
+
+int rate_limit_init(rate_limit_t *limit, size_t count) {
+  limit->last = calloc(count ? count : 1, sizeof(uint64_t));
+  if (!limit->last)
+    return -1;
+  limit->count = count;
+  limit->allowed = 0;
+  limit->dropped = 0;
+  return 0;
+}
+
+// Check whether a record may be multicast now, without stamping it
+bool rate_limit_ready(const rate_limit_t *limit, size_t slot, uint64_t now,
+                      uint64_t interval) {
+  if (slot >= limit->count)
+    return true;
+  return !limit->last[slot] || (now >= limit->last[slot] + interval);
+}
+
+// Check whether a record may be multicast now, and if so stamp it as sent
+bool rate_limit_allow(rate_limit_t *limit, size_t slot, uint64_t now,
+                      uint64_t interval) {
+  if (slot >= limit->count)
+    return true;
+  if (!rate_limit_ready(limit, slot, now, interval)) {
+    limit->dropped++;
+    return false;
+  }
+  limit->last[slot] = now;
+  limit->allowed++;
+  return true;
+}
+
+// Record a multicast the limit does not apply to, such as an announcement
+void rate_limit_stamp(rate_limit_t *limit, size_t slot, uint64_t now) {
+  if (slot < limit->count)
+    limit->last[slot] = now;
+}
+
+void rate_limit_free(rate_limit_t *limit) {
+  free(limit->last);
+  limit->last = NULL;
+  limit->count = 0;
+}
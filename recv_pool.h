@@ -0,0 +1,108 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Receive buffers taken from one allocation and reused between reads. They
+// are never cleared, each read only looks at the bytes it received. When all
+// of them are in use a buffer is allocated for the read and freed after.
+typedef struct {
+  char *block;
+  size_t buffer_size;
+  size_t count;
+  // Indices of the buffers not in use, taken from the end
+  size_t *free;
+  size_t free_count;
+  // Whether each buffer is handed out, to refuse giving one back twice
+  unsigned char *taken;
+  // Buffers handed out now, the most handed out at once, and the reads that
+  // found every buffer in use
+  size_t in_use;
+  size_t high_water;
+  uint64_t exhausted;
+} recv_pool_t;
+
+int recv_pool_init(recv_pool_t *pool, size_t count, size_t buffer_size);
+
+char *recv_pool_get(recv_pool_t *pool);
+
+int recv_pool_put(recv_pool_t *pool, char *buffer);
+
+void recv_pool_free(recv_pool_t *pool);
+
+int recv_pool_init(recv_pool_t *pool, size_t count, size_t buffer_size) {
+  pool->block = malloc(count * buffer_size);
+  pool->free = malloc(count * sizeof(size_t));
+  pool->taken = calloc(count ? count : 1, 1);
+  if (!pool->block || !pool->free || !pool->taken) {
+    free(pool->block);
+    free(pool->free);
+    free(pool->taken);
+    pool->block = NULL;
+    pool->free = NULL;
+    pool->taken = NULL;
+    return -1;
+  }
+  pool->buffer_size = buffer_size;
+  pool->count = count;
+  for (size_t i = 0; i < count; i++)
+    pool->free[i] = count - 1 - i;
+  pool->free_count = count;
+  pool->in_use = 0;
+  pool->high_water = 0;
+  pool->exhausted = 0;
+  return 0;
+}
+
+// A buffer of buffer_size bytes, NULL only if the pool is empty and
+// allocating one failed
+char *recv_pool_get(recv_pool_t *pool) {
+  char *buffer;
+  if (pool->free_count) {
+    size_t index = pool->free[--pool->free_count];
+    pool->taken[index] = 1;
+    buffer = pool->block + index * pool->buffer_size;
+  } else {
+    pool->exhausted++;
+    buffer = malloc(pool->buffer_size);
+    if (!buffer)
+      return NULL;
+  }
+  pool->in_use++;
+  if (pool->in_use > pool->high_water)
+    pool->high_water = pool->in_use;
+  return buffer;
+}
+
+// Give back a buffer from recv_pool_get. Returns -1 and leaves the pool as
+// it was for a pointer into the pool that is not the start of a buffer
+// handed out, such as a chunk of one or a buffer already given back.
+int recv_pool_put(recv_pool_t *pool, char *buffer) {
+  if (!buffer)
+    return 0;
+  if (pool->block && (buffer >= pool->block) &&
+      (buffer < pool->block + pool->count * pool->buffer_size)) {
+    size_t offset = (size_t)(buffer - pool->block);
+    size_t index = offset / pool->buffer_size;
+    if ((offset % pool->buffer_size) || !pool->taken[index])
+      return -1;
+    pool->taken[index] = 0;
+    pool->free[pool->free_count++] = index;
+    pool->in_use--;
+    return 0;
+  }
+  pool->in_use--;
+  free(buffer);
+  return 0;
+}
+
+void recv_pool_free(recv_pool_t *pool) {
+  free(pool->block);
+  free(pool->free);
+  free(pool->taken);
+  pool->block = NULL;
+  pool->free = NULL;
+  pool->taken = NULL;
+  pool->count = 0;
+  pool->free_count = 0;
+}
@@ -0,0 +1,271 @@
+#pragma once
+#include "mdns.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Questions beyond this are answered but not echoed in a unicast answer
+#define RESPONSE_BUILDER_QUESTIONS 16
+
+typedef struct {
+  const mdns_record_t *record;
+  uint32_t generation;
+  bool answer;
+  // Held by the querier already, never added
+  bool known;
+} response_builder_seen_t;
+
+// Answers to every question in a received packet, collected so they go out
+// together in as few packets as possible. Records are referenced, not copied,
+// and each record is added once: a record already answering a question is
+// not repeated as an additional record. Records the querier listed as known
+// answers are not added at all. The arrays keep their allocations between
+// packets.
+typedef struct {
+  const mdns_record_t **answers;
+  size_t answers_count;
+  const mdns_record_t **additional;
+  size_t additional_count;
+  // Capacity of each of the record arrays
+  size_t capacity;
+  // Questions answered, echoed in a unicast answer
+  mdns_query_t questions[RESPONSE_BUILDER_QUESTIONS];
+  size_t questions_count;
+  // Number of questions that added any records
+  size_t sources;
+  // Known answers marked, and records left out because of them
+  size_t known_count;
+  size_t suppressed;
+  // Open-addressing set of the records added to the current packet, stamped
+  // with the generation so a reset does not need to clear it
+  response_builder_seen_t *seen;
+  size_t seen_mask;
+  uint32_t generation;
+} response_builder_t;
+
+void response_builder_reset(response_builder_t *builder);
+
+int response_builder_question(response_builder_t *builder,
+                              mdns_record_type_t rtype, mdns_string_t name);
+
+int response_builder_known(response_builder_t *builder,
+                           const mdns_record_t *record);
+
+int response_builder_answer(response_builder_t *builder,
+                            const mdns_record_t *record);
+
+int response_builder_additional(response_builder_t *builder,
+                                const mdns_record_t *record);
+
+int response_builder_remove(response_builder_t *builder,
+                            const mdns_record_t *record);
+
+void response_builder_finish(response_builder_t *builder);
+
+void response_builder_free(response_builder_t *builder);
+
+void response_builder_reset(response_builder_t *builder) {
+  builder->answers_count = 0;
+  builder->additional_count = 0;
+  builder->questions_count = 0;
+  builder->sources = 0;
+  builder->known_count = 0;
+  builder->suppressed = 0;
+  builder->generation++;
+  // Stamps wrapped around, clear the set for real
+  if (!builder->generation && builder->seen) {
+    for (size_t i = 0; i <= builder->seen_mask; i++)
+      builder->seen[i].generation = 0;
+    builder->generation = 1;
+  }
+}
+
+int response_builder_question(response_builder_t *builder,
+                              mdns_record_type_t rtype, mdns_string_t name) {
+  builder->sources++;
+  for (size_t i = 0; i < builder->questions_count; i++) {
+    const mdns_query_t *question = &builder->questions[i];
+    if ((question->type == rtype) && (question->name == name.str))
+      return 0;
+  }
+  if (builder->questions_count == RESPONSE_BUILDER_QUESTIONS)
+    return 0;
+  mdns_query_t *question = &builder->questions[builder->questions_count++];
+  question->type = rtype;
+  question->name = name.str;
+  question->length = name.length;
+  return 0;
+}
+
+static size_t response_builder_slot(const response_builder_t *builder,
+                                    const mdns_record_t *record) {
+  uintptr_t key = (uintptr_t)record;
+  key ^= key >> 17;
+  key *= 0x9E3779B1U;
+  size_t slot = (size_t)key & builder->seen_mask;
+  while ((builder->seen[slot].generation == builder->generation) &&
+         (builder->seen[slot].record != record))
+    slot = (slot + 1) & builder->seen_mask;
+  return slot;
+}
+
+// Grow the record arrays and the seen set to fit one more record
+static int response_builder_reserve(response_builder_t *builder) {
+  size_t count = builder->answers_count + builder->additional_count +
+                 builder->known_count;
+  if (count < builder->capacity)
+    return 0;
+
+  size_t capacity = builder->capacity ? builder->capacity * 2 : 64;
+  const mdns_record_t **answers =
+      realloc(builder->answers, capacity * sizeof(*answers));
+  if (!answers)
+    return -1;
+  builder->answers = answers;
+  const mdns_record_t **additional =
+      realloc(builder->additional, capacity * sizeof(*additional));
+  if (!additional)
+    return -1;
+  builder->additional = additional;
+
+  // Keep the set at most half full, rehashing what the packet added so far
+  size_t seen_size = capacity * 2;
+  response_builder_seen_t *seen =
+      calloc(seen_size, sizeof(response_builder_seen_t));
+  if (!seen)
+    return -1;
+  response_builder_seen_t *previous = builder->seen;
+  size_t previous_mask = builder->seen_mask;
+  uint32_t previous_generation = builder->generation;
+  builder->seen = seen;
+  builder->seen_mask = seen_size - 1;
+  builder->generation = 1;
+  if (previous) {
+    for (size_t i = 0; i <= previous_mask; i++) {
+      if (previous[i].generation != previous_generation)
+        continue;
+      size_t slot = response_builder_slot(builder, previous[i].record);
+      builder->seen[slot] = previous[i];
+      builder->seen[slot].generation = builder->generation;
+    }
+    free(previous);
+  }
+  builder->capacity = capacity;
+  return 0;
+}
+
+// Mark a record the querier already holds, so it is left out of the packet
+int response_builder_known(response_builder_t *builder,
+                           const mdns_record_t *record) {
+  if (response_builder_reserve(builder) < 0)
+    return -1;
+  size_t slot = response_builder_slot(builder, record);
+  if (builder->seen[slot].generation == builder->generation)
+    return 0;
+  builder->seen[slot].record = record;
+  builder->seen[slot].generation = builder->generation;
+  builder->seen[slot].answer = false;
+  builder->seen[slot].known = true;
+  builder->known_count++;
+  return 0;
+}
+
+// Add an answer, returns 1 if it is left out as the querier holds it
+int response_builder_answer(response_builder_t *builder,
+                            const mdns_record_t *record) {
+  if (response_builder_reserve(builder) < 0)
+    return -1;
+  size_t slot = response_builder_slot(builder, record);
+  if (builder->seen[slot].generation == builder->generation) {
+    if (builder->seen[slot].known) {
+      builder->suppressed++;
+      return 1;
+    }
+    if (builder->seen[slot].answer)
+      return 0;
+    // Added as additional record before, dropped from there by finish
+    builder->seen[slot].answer = true;
+  } else {
+    builder->seen[slot].record = record;
+    builder->seen[slot].generation = builder->generation;
+    builder->seen[slot].answer = true;
+    builder->seen[slot].known = false;
+  }
+  builder->answers[builder->answers_count++] = record;
+  return 0;
+}
+
+int response_builder_additional(response_builder_t *builder,
+                                const mdns_record_t *record) {
+  if (response_builder_reserve(builder) < 0)
+    return -1;
+  size_t slot = response_builder_slot(builder, record);
+  if (builder->seen[slot].generation == builder->generation) {
+    if (builder->seen[slot].known)
+      builder->suppressed++;
+    return 0;
+  }
+  builder->seen[slot].record = record;
+  builder->seen[slot].generation = builder->generation;
+  builder->seen[slot].answer = false;
+  builder->seen[slot].known = false;
+  builder->additional[builder->additional_count++] = record;
+  return 0;
+}
+
+// Take a record out again, wherever it was added, and keep it out as if the
+// querier held it. Returns 1 if the record had been added.
+int response_builder_remove(response_builder_t *builder,
+                            const mdns_record_t *record) {
+  if (response_builder_reserve(builder) < 0)
+    return -1;
+  size_t slot = response_builder_slot(builder, record);
+  response_builder_seen_t *seen = &builder->seen[slot];
+  bool added = (seen->generation == builder->generation) && !seen->known;
+  if (seen->generation != builder->generation) {
+    seen->record = record;
+    seen->generation = builder->generation;
+    builder->known_count++;
+  }
+  seen->answer = false;
+  seen->known = true;
+  if (!added)
+    return 0;
+
+  size_t count = 0;
+  for (size_t i = 0; i < builder->answers_count; i++) {
+    if (builder->answers[i] != record)
+      builder->answers[count++] = builder->answers[i];
+  }
+  builder->answers_count = count;
+  count = 0;
+  for (size_t i = 0; i < builder->additional_count; i++) {
+    if (builder->additional[i] != record)
+      builder->additional[count++] = builder->additional[i];
+  }
+  builder->additional_count = count;
+  return 1;
+}
+
+void response_builder_finish(response_builder_t *builder) {
+  size_t count = 0;
+  for (size_t i = 0; i < builder->additional_count; i++) {
+    const mdns_record_t *record = builder->additional[i];
+    size_t slot = response_builder_slot(builder, record);
+    if (!builder->seen[slot].answer)
+      builder->additional[count++] = record;
+  }
+  builder->additional_count = count;
+}
+
+void response_builder_free(response_builder_t *builder) {
+  free(builder->answers);
+  free(builder->additional);
+  free(builder->seen);
+  builder->answers = NULL;
+  builder->additional = NULL;
+  builder->seen = NULL;
+  builder->capacity = 0;
+  builder->seen_mask = 0;
+}
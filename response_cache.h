@@ -0,0 +1,101 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One cached answer per combination of the service name asked for, the type
+// asked for (the name's own type, TXT or ANY), and unicast or multicast
+#define RESPONSE_CACHE_SLOTS 12
+
+// A finished answer packet, sent with the query ID patched in
+typedef struct {
+  size_t size;
+  char data[];
+} response_t;
+
+// Serialized answers per service, filled on first use. The record set of a
+// service never changes while it is in the table, so entries only go away
+// when the table is rebuilt.
+typedef struct {
+  // RESPONSE_CACHE_SLOTS entries per service, NULL until first used
+  response_t **responses;
+  size_t services_count;
+  uint64_t hits;
+  uint64_t misses;
+} response_cache_t;
+
+int response_cache_init(response_cache_t *cache, size_t services_count);
+
+size_t response_cache_slot(bool instance, unsigned int variant, bool unicast);
+
+const response_t *response_cache_get(response_cache_t *cache, size_t service,
+                                     size_t slot);
+
+const response_t *response_cache_put(response_cache_t *cache, size_t service,
+                                     size_t slot, const void *data,
+                                     size_t size);
+
+void response_cache_clear(response_cache_t *cache);
+
+void response_cache_free(response_cache_t *cache);
+
+int response_cache_init(response_cache_t *cache, size_t services_count) {
+  cache->responses = calloc(services_count * RESPONSE_CACHE_SLOTS,
+                            sizeof(response_t *));
+  if (services_count && !cache->responses)
+    return -1;
+  cache->services_count = services_count;
+  cache->hits = 0;
+  cache->misses = 0;
+  return 0;
+}
+
+// Variant 0 is the name's own type, 1 TXT and 2 ANY
+size_t response_cache_slot(bool instance, unsigned int variant, bool unicast) {
+  return (((size_t)instance * 3 + variant) << 1) | (size_t)unicast;
+}
+
+const response_t *response_cache_get(response_cache_t *cache, size_t service,
+                                     size_t slot) {
+  if (service >= cache->services_count)
+    return NULL;
+  const response_t *response =
+      cache->responses[service * RESPONSE_CACHE_SLOTS + slot];
+  if (response)
+    cache->hits++;
+  else
+    cache->misses++;
+  return response;
+}
+
+const response_t *response_cache_put(response_cache_t *cache, size_t service,
+                                     size_t slot, const void *data,
+                                     size_t size) {
+  if (service >= cache->services_count)
+    return NULL;
+  response_t *response = malloc(sizeof(response_t) + size);
+  if (!response)
+    return NULL;
+  response->size = size;
+  memcpy(response->data, data, size);
+  response_t **entry = &cache->responses[service * RESPONSE_CACHE_SLOTS + slot];
+  free(*entry);
+  *entry = response;
+  return response;
+}
+
+void response_cache_clear(response_cache_t *cache) {
+  for (size_t i = 0; i < cache->services_count * RESPONSE_CACHE_SLOTS; i++) {
+    free(cache->responses[i]);
+    cache->responses[i] = NULL;
+  }
+}
+
+void response_cache_free(response_cache_t *cache) {
+  if (cache->responses)
+    response_cache_clear(cache);
+  free(cache->responses);
+  cache->responses = NULL;
+  cache->services_count = 0;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include "response_builder.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Window multicast answers with shared records are delayed by, in
+// milliseconds (RFC 6762 section 6)
+#define RESPONSE_DELAY_MIN 20
+#define RESPONSE_DELAY_MAX 120
+
+// Multicast answers held back for a random delay, so several queriers asking
+// for the same shared records get a single answer. Answers scheduled while
+// others are pending join them and go out together at the earliest time any
+// of them is due, each record once. Records another responder multicasts in
+// the meantime are cancelled.
+typedef struct {
+  response_builder_t pending;
+  // Loop time in milliseconds the pending answers are due, 0 if none are
+  uint64_t due;
+  uint32_t delay_min;
+  uint32_t delay_max;
+  // Answers scheduled, the ones dropped as already pending, and records
+  // cancelled as sent by another responder
+  uint64_t delayed;
+  uint64_t merged;
+  uint64_t cancelled;
+} response_scheduler_t;
+
+void response_scheduler_init(response_scheduler_t *scheduler,
+                             uint32_t delay_min, uint32_t delay_max);
+
+uint64_t response_scheduler_add(response_scheduler_t *scheduler,
+                                const response_builder_t *answers,
+                                uint64_t now);
+
+void response_scheduler_cancel(response_scheduler_t *scheduler,
+                               const mdns_record_t *record);
+
+bool response_scheduler_due(const response_scheduler_t *scheduler,
+                            uint64_t now);
+
+void response_scheduler_reset(response_scheduler_t *scheduler);
+
+void response_scheduler_free(response_scheduler_t *scheduler);
+
+void response_scheduler_init(response_scheduler_t *scheduler,
+                             uint32_t delay_min, uint32_t delay_max) {
+  response_builder_reset(&scheduler->pending);
+  scheduler->due = 0;
+  scheduler->delay_min = delay_min;
+  scheduler->delay_max = delay_max;
+  scheduler->delayed = 0;
+  scheduler->merged = 0;
+  scheduler->cancelled = 0;
+}
+
+// Add the records of a finished set of answers to the pending ones. Returns
+// the time the pending answers are due, or 0 if they could not be added.
+uint64_t response_scheduler_add(response_scheduler_t *scheduler,
+                                const response_builder_t *answers,
+                                uint64_t now) {
+  response_builder_t *pending = &scheduler->pending;
+  for (size_t i = 0; i < answers->answers_count; i++) {
+    size_t count = pending->answers_count;
+    int ret = response_builder_answer(pending, answers->answers[i]);
+    if (ret < 0)
+      return 0;
+    if (!ret && (pending->answers_count == count))
+      scheduler->merged++;
+  }
+  for (size_t i = 0; i < answers->additional_count; i++) {
+    if (response_builder_additional(pending, answers->additional[i]) < 0)
+      return 0;
+  }
+  pending->sources += answers->sources;
+  scheduler->delayed += answers->answers_count;
+
+  uint32_t range = scheduler->delay_max - scheduler->delay_min;
+  uint64_t due = now + scheduler->delay_min +
+                 (range ? (uint64_t)(rand() % (range + 1)) : 0);
+  if (!scheduler->due || (due < scheduler->due))
+    scheduler->due = due;
+  return scheduler->due;
+}
+
+// Drop a record another responder has just multicast from the pending
+// answers, and keep it from being scheduled again until they are sent
+void response_scheduler_cancel(response_scheduler_t *scheduler,
+                               const mdns_record_t *record) {
+  if (!scheduler->due)
+    return;
+  if (response_builder_remove(&scheduler->pending, record) > 0)
+    scheduler->cancelled++;
+}
+
+bool response_scheduler_due(const response_scheduler_t *scheduler,
+                            uint64_t now) {
+  return scheduler->due && (scheduler->due <= now);
+}
+
+// Forget the pending answers once sent
+void response_scheduler_reset(response_scheduler_t *scheduler) {
+  response_builder_reset(&scheduler->pending);
+  scheduler->due = 0;
+}
+
+void response_scheduler_free(response_scheduler_t *scheduler) {
+  response_builder_free(&scheduler->pending);
+  scheduler->due = 0;
+}
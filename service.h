@@ -1,6 +1,7 @@
 #pragma once
 #include "mdns.h"
 #include <netinet/in.h>
+#include <stdbool.h>
 
 // Data for our service including the mDNS records
 typedef struct {
@@ -8,20 +9,87 @@ typedef struct {
   mdns_string_t hostname;
   mdns_string_t service_instance;
   mdns_string_t hostname_qualified;
+  // The names above pre-encoded as DNS label sequences, and their
+  // case-folded hashes, for matching against names in received packets
+  mdns_string_t service_wire;
+  mdns_string_t service_instance_wire;
+  mdns_string_t hostname_qualified_wire;
+  uint32_t service_hash;
+  uint32_t service_instance_hash;
+  uint32_t hostname_qualified_hash;
   struct sockaddr_in address_ipv4;
   int port;
   mdns_record_t record_ptr;
   mdns_record_t record_srv;
   mdns_record_t record_a;
   mdns_record_t txt_record[2];
-  void *buffer;
-  int buffer_size;
+  // The types the service instance name and the hostname have, for
+  // negative answers to any other type
+  mdns_record_t record_nsec_instance;
+  mdns_record_t record_nsec_hostname;
 } service_t;
 
 service_t service_create(char *ip, char *host);
 
 void service_free(service_t *service);
 
+mdns_string_t service_name_encode(mdns_string_t name, uint32_t *hash);
+
+mdns_string_t service_record_encode(const mdns_record_t *record);
+
+mdns_string_t service_nsec_encode(const uint16_t *types, size_t count);
+
+bool service_names_valid(const service_t *service);
+
+// Encode a dotted name as an uncompressed DNS label sequence and hash it the
+// same way mdns_string_hash hashes names inside received packets. Returns a
+// null string for a name that cannot be encoded, such as one with too many
+// labels.
+mdns_string_t service_name_encode(mdns_string_t name, uint32_t *hash) {
+  size_t capacity = name.length + 2;
+  char *buffer = malloc(capacity);
+  if (!buffer)
+    return (mdns_string_t){0};
+  void *end = mdns_string_make(buffer, capacity, buffer, name.str,
+                               name.length, NULL);
+  if (!end) {
+    free(buffer);
+    return (mdns_string_t){0};
+  }
+  mdns_string_t wire = {buffer, MDNS_POINTER_DIFF(end, buffer)};
+  mdns_string_hash(wire.str, wire.length, 0, hash);
+  return wire;
+}
+
+// Encode the RDATA of a record without names once, so answers copy it
+// instead of serializing the record every time
+mdns_string_t service_record_encode(const mdns_record_t *record) {
+  char buffer[256];
+  size_t size = mdns_record_rdata_encode(record, buffer, sizeof(buffer));
+  char *rdata = size ? malloc(size) : NULL;
+  if (!rdata)
+    return (mdns_string_t){0};
+  memcpy(rdata, buffer, size);
+  return (mdns_string_t){rdata, size};
+}
+
+// Encode the type bitmap of an NSEC record once
+mdns_string_t service_nsec_encode(const uint16_t *types, size_t count) {
+  char buffer[34];
+  size_t size = mdns_nsec_bitmap_encode(types, count, buffer, sizeof(buffer));
+  char *bitmap = size ? malloc(size) : NULL;
+  if (!bitmap)
+    return (mdns_string_t){0};
+  memcpy(bitmap, buffer, size);
+  return (mdns_string_t){bitmap, size};
+}
+
+// Whether every name of a service could be encoded
+bool service_names_valid(const service_t *service) {
+  return service->service_wire.str && service->service_instance_wire.str &&
+         service->hostname_qualified_wire.str;
+}
+
 service_t service_create(char *ip, char *hostname) {
 
   char *service_name = "_http._tcp.local.";
@@ -63,11 +131,14 @@ service_t service_create(char *ip, char *hostname) {
   service.hostname = hostname_string;
   service.service_instance = service_instance_string;
   service.hostname_qualified = hostname_qualified_string;
+  service.service_wire =
+      service_name_encode(service_string, &service.service_hash);
+  service.service_instance_wire = service_name_encode(
+      service_instance_string, &service.service_instance_hash);
+  service.hostname_qualified_wire = service_name_encode(
+      hostname_qualified_string, &service.hostname_qualified_hash);
   service.address_ipv4 = service_address;
   service.port = 80;
-  // utility buffer for announce/goodbye
-  service.buffer_size = 2048;
-  service.buffer = malloc(service.buffer_size);
 
   // Setup our mDNS records
 
@@ -98,9 +169,10 @@ service_t service_create(char *ip, char *hostname) {
                                      .data.a.addr = service.address_ipv4,
                                      .rclass = 0,
                                      .ttl = 1};
+  service.record_a.rdata = service_record_encode(&service.record_a);
 
-  // Add TXT records for our service instance name, will be coalesced
-  // into one record with both key-value pair strings by the library
+  // Add TXT records for our service instance name, pre-encoded as one
+  // record with the key-value pair string
   service.txt_record[0] =
       (mdns_record_t){.name = service.service_instance,
                       .type = MDNS_RECORDTYPE_TXT,
@@ -108,6 +180,28 @@ service_t service_create(char *ip, char *hostname) {
                       .data.txt.value = {MDNS_STRING_CONST("mdns-mingler")},
                       .rclass = 0,
                       .ttl = 1};
+  service.txt_record[0].rdata = service_record_encode(&service.txt_record[0]);
+
+  // NSEC records asserting "<hostname>.<_service-name>._tcp.local." only has
+  // SRV and TXT records, and "<hostname>.local." only an A record
+  uint16_t instance_types[] = {MDNS_RECORDTYPE_TXT, MDNS_RECORDTYPE_SRV};
+  service.record_nsec_instance =
+      (mdns_record_t){.name = service.service_instance,
+                      .type = MDNS_RECORDTYPE_NSEC,
+                      .data.nsec.name = service.service_instance,
+                      .data.nsec.bitmap =
+                          service_nsec_encode(instance_types, 2),
+                      .rclass = 0,
+                      .ttl = 1};
+  uint16_t hostname_types[] = {MDNS_RECORDTYPE_A};
+  service.record_nsec_hostname =
+      (mdns_record_t){.name = service.hostname_qualified,
+                      .type = MDNS_RECORDTYPE_NSEC,
+                      .data.nsec.name = service.hostname_qualified,
+                      .data.nsec.bitmap =
+                          service_nsec_encode(hostname_types, 1),
+                      .rclass = 0,
+                      .ttl = 1};
   return service;
 }
 
@@ -115,5 +209,11 @@ void service_free(service_t *service) {
   free((char *)service->service.str);
   free((char *)service->service_instance.str);
   free((char *)service->hostname_qualified.str);
-  free(service->buffer);
+  free((char *)service->service_wire.str);
+  free((char *)service->service_instance_wire.str);
+  free((char *)service->hostname_qualified_wire.str);
+  free((char *)service->record_a.rdata.str);
+  free((char *)service->txt_record[0].rdata.str);
+  free((char *)service->record_nsec_instance.data.nsec.bitmap.str);
+  free((char *)service->record_nsec_hostname.data.nsec.bitmap.str);
 }
@@ -0,0 +1,374 @@
+#pragma once
+#include "bloom.h"
+#include "service.h"
+
+#define SERVICE_DNS_SD_NAME "_services._dns-sd._udp.local."
+
+// SERVICE_DNS_SD_NAME as a label sequence
+static const uint8_t service_dns_sd_wire[] = {
+    0x09, '_', 's', 'e', 'r', 'v', 'i', 'c', 'e', 's', 0x07, '_', 'd', 'n', 's',
+    '-', 's', 'd', 0x04, '_', 'u', 'd', 'p', 0x05, 'l', 'o', 'c', 'a', 'l',
+    0x00};
+
+// Which of a service's names a question matched. Service types are shared
+// between services and kept separately, see service_type_t.
+typedef enum {
+  SERVICE_NAME_NONE = 0,
+  SERVICE_NAME_INSTANCE,
+  SERVICE_NAME_HOSTNAME,
+} service_name_kind_t;
+
+typedef struct {
+  uint32_t hash;
+  // Position in the services array, -1 marks an empty slot
+  int32_t service;
+  service_name_kind_t kind;
+} service_index_slot_t;
+
+// A service type shared by one or more services, with the records answering
+// a browse for it: a PTR record per instance, and the SRV, A and TXT records
+// of every instance as additional records. The DNS-SD enumeration PTR record
+// mapping to the type is kept here too.
+typedef struct {
+  uint32_t hash;
+  mdns_string_t name;
+  mdns_string_t wire;
+  mdns_record_t record_dns_sd;
+  const mdns_record_t **answers;
+  size_t answer_count;
+  const mdns_record_t **additional;
+  size_t additional_count;
+  // Where the records of each instance start in additional, followed by the
+  // end of the last one
+  size_t *additional_start;
+} service_type_t;
+
+// Open-addressing (linear probing) index from qualified hostnames and service
+// instance names to services. The capacity is a power of two kept at least
+// twice the entry count so probe sequences stay short. The distinct service
+// types are few and kept in a plain array next to it, along with the answer
+// to a DNS-SD service type enumeration.
+//
+// The filter holds the hashes of the first label and of the full name of
+// every name we answer for, so most questions for other names can be
+// rejected without a lookup.
+typedef struct {
+  service_index_slot_t *slots;
+  size_t capacity;
+  size_t count;
+  service_type_t *types;
+  size_t types_count;
+  const mdns_record_t **dns_sd_answers;
+  bloom_t filter;
+} service_index_t;
+
+int service_index_build(service_index_t *index, const service_t *services,
+                        int services_count);
+
+int service_index_find(const service_index_t *index, const service_t *services,
+                       const mdns_label_table_t *table, const void *buffer,
+                       uint16_t label, uint32_t hash,
+                       service_name_kind_t *kind);
+
+const service_type_t *
+service_index_find_type(const service_index_t *index,
+                        const mdns_label_table_t *table, const void *buffer,
+                        uint16_t label, uint32_t hash);
+
+bool service_index_filter(const service_index_t *index,
+                          const mdns_label_table_t *table, const void *buffer,
+                          uint16_t label, uint32_t *hash);
+
+const mdns_record_t *
+service_index_find_record(const service_index_t *index,
+                          const service_t *services,
+                          const mdns_label_table_t *table, const void *buffer,
+                          const mdns_known_answer_t *answer);
+
+void service_index_free(service_index_t *index);
+
+static mdns_string_t service_index_name(const service_t *service,
+                                        service_name_kind_t kind) {
+  if (kind == SERVICE_NAME_INSTANCE)
+    return service->service_instance_wire;
+  return service->hostname_qualified_wire;
+}
+
+static void service_index_insert(service_index_t *index, uint32_t hash,
+                                 int32_t service, service_name_kind_t kind) {
+  size_t mask = index->capacity - 1;
+  size_t slot = hash & mask;
+  while (index->slots[slot].service >= 0)
+    slot = (slot + 1) & mask;
+  index->slots[slot].hash = hash;
+  index->slots[slot].service = service;
+  index->slots[slot].kind = kind;
+  index->count++;
+}
+
+static service_type_t *service_index_add_type(service_index_t *index,
+                                              const service_t *service,
+                                              int services_count) {
+  for (size_t i = 0; i < index->types_count; i++) {
+    service_type_t *type = &index->types[i];
+    if ((type->hash == service->service_hash) &&
+        (type->wire.length == service->service_wire.length) &&
+        (strncasecmp(type->wire.str, service->service_wire.str,
+                     type->wire.length) == 0))
+      return type;
+  }
+
+  service_type_t *type = &index->types[index->types_count];
+  type->hash = service->service_hash;
+  type->name = service->service;
+  type->wire = service->service_wire;
+  // PTR record mapping "_services._dns-sd._udp.local." to
+  // "<_service-name>._tcp.local."
+  type->record_dns_sd =
+      (mdns_record_t){.name = {MDNS_STRING_CONST(SERVICE_DNS_SD_NAME)},
+                      .type = MDNS_RECORDTYPE_PTR,
+                      .data.ptr.name = service->service,
+                      .rclass = 0,
+                      .ttl = 0};
+  index->dns_sd_answers[index->types_count++] = &type->record_dns_sd;
+  type->answers = malloc(services_count * sizeof(mdns_record_t *));
+  type->answer_count = 0;
+  type->additional = malloc(services_count * 3 * sizeof(mdns_record_t *));
+  type->additional_count = 0;
+  type->additional_start = malloc((services_count + 1) * sizeof(size_t));
+  if (type->additional_start)
+    type->additional_start[0] = 0;
+  return type;
+}
+
+// Add a pre-encoded name to the filter, by its first label and in full
+static void service_index_filter_add(service_index_t *index, const void *wire,
+                                     uint32_t hash) {
+  const uint8_t *label = (const uint8_t *)wire;
+  bloom_add(&index->filter,
+            mdns_hash_update(MDNS_HASH_INIT, label + 1, *label));
+  bloom_add(&index->filter, hash);
+}
+
+int service_index_build(service_index_t *index, const service_t *services,
+                        int services_count) {
+  size_t entries = (size_t)services_count * 2;
+  size_t capacity = 16;
+  while (capacity < entries * 2)
+    capacity <<= 1;
+
+  index->slots = malloc(capacity * sizeof(service_index_slot_t));
+  if (!index->slots)
+    return -1;
+  index->capacity = capacity;
+  index->count = 0;
+  for (size_t i = 0; i < capacity; i++) {
+    index->slots[i].service = -1;
+  }
+
+  size_t types_capacity = services_count ? services_count : 1;
+  index->types = calloc(types_capacity, sizeof(service_type_t));
+  index->types_count = 0;
+  index->dns_sd_answers = malloc(types_capacity * sizeof(mdns_record_t *));
+  if (!index->types || !index->dns_sd_answers)
+    return -1;
+
+  for (int i = 0; i < services_count; i++) {
+    const service_t *service = &services[i];
+    service_index_insert(index, service->service_instance_hash, i,
+                         SERVICE_NAME_INSTANCE);
+    service_index_insert(index, service->hostname_qualified_hash, i,
+                         SERVICE_NAME_HOSTNAME);
+
+    service_type_t *type =
+        service_index_add_type(index, service, services_count);
+    if (!type->answers || !type->additional || !type->additional_start)
+      return -1;
+    type->answers[type->answer_count++] = &service->record_ptr;
+    type->additional[type->additional_count++] = &service->record_srv;
+    if (service->address_ipv4.sin_family == AF_INET)
+      type->additional[type->additional_count++] = &service->record_a;
+    type->additional[type->additional_count++] = &service->txt_record[0];
+    type->additional_start[type->answer_count] = type->additional_count;
+  }
+
+  // Two names per service, plus the service types and DNS-SD name, each
+  // added by its first label and in full
+  if (bloom_init(&index->filter, 2 * (entries + index->types_count + 1)) < 0)
+    return -1;
+  for (int i = 0; i < services_count; i++) {
+    service_index_filter_add(index, services[i].service_instance_wire.str,
+                             services[i].service_instance_hash);
+    service_index_filter_add(index, services[i].hostname_qualified_wire.str,
+                             services[i].hostname_qualified_hash);
+  }
+  for (size_t i = 0; i < index->types_count; i++) {
+    service_index_filter_add(index, index->types[i].wire.str,
+                             index->types[i].hash);
+  }
+  uint32_t dns_sd_hash;
+  if (!mdns_string_hash(service_dns_sd_wire, sizeof(service_dns_sd_wire), 0,
+                        &dns_sd_hash))
+    return -1;
+  service_index_filter_add(index, service_dns_sd_wire, dns_sd_hash);
+  return 0;
+}
+
+// Look up the service owning a name decoded into the packet label table. The
+// name is compared label by label against the pre-encoded service names.
+// Returns the position of the service, or -1 if none owns the name.
+int service_index_find(const service_index_t *index, const service_t *services,
+                       const mdns_label_table_t *table, const void *buffer,
+                       uint16_t label, uint32_t hash,
+                       service_name_kind_t *kind) {
+  if (!index->capacity)
+    return -1;
+  size_t mask = index->capacity - 1;
+  for (size_t slot = hash & mask; index->slots[slot].service >= 0;
+       slot = (slot + 1) & mask) {
+    const service_index_slot_t *entry = &index->slots[slot];
+    if (entry->hash != hash)
+      continue;
+    mdns_string_t wire =
+        service_index_name(&services[entry->service], entry->kind);
+    if (mdns_label_table_equal(table, buffer, label, wire.str, wire.length)) {
+      *kind = entry->kind;
+      return entry->service;
+    }
+  }
+  return -1;
+}
+
+// Look up the service type a name decoded into the packet label table refers
+// to, or NULL if it is not one we advertise
+const service_type_t *
+service_index_find_type(const service_index_t *index,
+                        const mdns_label_table_t *table, const void *buffer,
+                        uint16_t label, uint32_t hash) {
+  for (size_t i = 0; i < index->types_count; i++) {
+    const service_type_t *type = &index->types[i];
+    if ((type->hash == hash) &&
+        mdns_label_table_equal(table, buffer, label, type->wire.str,
+                               type->wire.length))
+      return type;
+  }
+  return NULL;
+}
+
+// Check a name decoded into the packet label table against the filter, first
+// by its first label and only then in full. Returns false if the name is
+// certainly not one of ours, otherwise stores the full name hash for the
+// lookup that must follow.
+bool service_index_filter(const service_index_t *index,
+                          const mdns_label_table_t *table, const void *buffer,
+                          uint16_t label, uint32_t *hash) {
+  if (label == MDNS_LABEL_NONE)
+    return false;
+  const mdns_label_t *first = &table->labels[label];
+  uint32_t first_hash = mdns_hash_update(
+      MDNS_HASH_INIT, MDNS_POINTER_OFFSET_CONST(buffer, first->offset),
+      first->length);
+  if (!bloom_check(&index->filter, first_hash))
+    return false;
+  *hash = mdns_label_table_hash(table, buffer, label);
+  return bloom_check(&index->filter, *hash);
+}
+
+// Compare the RDATA of a known answer with the pre-encoded RDATA of a record
+static bool service_index_rdata_equal(const mdns_record_t *record,
+                                      const void *buffer,
+                                      const mdns_known_answer_t *answer) {
+  return (answer->rdata_length == record->rdata.length) &&
+         !memcmp(MDNS_POINTER_OFFSET_CONST(buffer, answer->rdata_offset),
+                 record->rdata.str, record->rdata.length);
+}
+
+// Look up which of our records a known answer decoded into the packet label
+// table is, comparing its name, type and RDATA. Returns NULL if it is not one
+// of ours, or holds different data.
+const mdns_record_t *
+service_index_find_record(const service_index_t *index,
+                          const service_t *services,
+                          const mdns_label_table_t *table, const void *buffer,
+                          const mdns_known_answer_t *answer) {
+  uint32_t hash;
+  if (!service_index_filter(index, table, buffer, answer->name_label, &hash))
+    return NULL;
+
+  if (answer->rtype == MDNS_RECORDTYPE_PTR) {
+    uint32_t rdata_hash;
+    if (!service_index_filter(index, table, buffer, answer->rdata_label,
+                              &rdata_hash))
+      return NULL;
+    // Enumeration of service types, pointing at one of our types
+    if (mdns_label_table_equal(table, buffer, answer->name_label,
+                               service_dns_sd_wire,
+                               sizeof(service_dns_sd_wire))) {
+      const service_type_t *type = service_index_find_type(
+          index, table, buffer, answer->rdata_label, rdata_hash);
+      return type ? &type->record_dns_sd : NULL;
+    }
+    // Browse for a service type, pointing at one of its instances
+    const service_type_t *type =
+        service_index_find_type(index, table, buffer, answer->name_label, hash);
+    service_name_kind_t kind = SERVICE_NAME_NONE;
+    int found = service_index_find(index, services, table, buffer,
+                                   answer->rdata_label, rdata_hash, &kind);
+    if (!type || (found < 0) || (kind != SERVICE_NAME_INSTANCE) ||
+        (services[found].service_hash != type->hash))
+      return NULL;
+    return &services[found].record_ptr;
+  }
+
+  service_name_kind_t kind = SERVICE_NAME_NONE;
+  int found = service_index_find(index, services, table, buffer,
+                                 answer->name_label, hash, &kind);
+  if (found < 0)
+    return NULL;
+  const service_t *service = &services[found];
+
+  if ((answer->rtype == MDNS_RECORDTYPE_SRV) &&
+      (kind == SERVICE_NAME_INSTANCE)) {
+    const mdns_record_t *record = &service->record_srv;
+    const uint16_t *data = (const uint16_t *)MDNS_POINTER_OFFSET_CONST(
+        buffer, answer->rdata_offset);
+    if ((answer->rdata_label == MDNS_LABEL_NONE) ||
+        (mdns_ntohs(data) != record->data.srv.priority) ||
+        (mdns_ntohs(data + 1) != record->data.srv.weight) ||
+        (mdns_ntohs(data + 2) != record->data.srv.port) ||
+        !mdns_label_table_equal(table, buffer, answer->rdata_label,
+                                service->hostname_qualified_wire.str,
+                                service->hostname_qualified_wire.length))
+      return NULL;
+    return record;
+  }
+  if ((answer->rtype == MDNS_RECORDTYPE_TXT) &&
+      (kind == SERVICE_NAME_INSTANCE)) {
+    const mdns_record_t *record = &service->txt_record[0];
+    return service_index_rdata_equal(record, buffer, answer) ? record : NULL;
+  }
+  if ((answer->rtype == MDNS_RECORDTYPE_A) &&
+      (kind == SERVICE_NAME_HOSTNAME)) {
+    const mdns_record_t *record = &service->record_a;
+    return service_index_rdata_equal(record, buffer, answer) ? record : NULL;
+  }
+  return NULL;
+}
+
+void service_index_free(service_index_t *index) {
+  bloom_free(&index->filter);
+  for (size_t i = 0; i < index->types_count; i++) {
+    free(index->types[i].answers);
+    free(index->types[i].additional);
+    free(index->types[i].additional_start);
+  }
+  free(index->types);
+  free(index->dns_sd_answers);
+  index->types = NULL;
+  index->types_count = 0;
+  index->dns_sd_answers = NULL;
+  free(index->slots);
+  index->slots = NULL;
+  index->capacity = 0;
+  index->count = 0;
+}
@@ -0,0 +1,283 @@
+#include "../mdns.h"
+#include "../service.h"
+#include "../service_index.h"
+#include <stdio.h>
+#include <time.h>
+
+// Encodes the browse answer of a service type with n hosts, answers and their
+// additionals split over packets of the given size, with names written out in
+// full, through the 16-slot ring the name compression used to be, and through
+// the current dictionary. Usage: bench_compression [hosts] [packet size]
+
+#define ITERATIONS 2000
+
+typedef struct {
+  size_t packets;
+  size_t bytes;
+  double us;
+} result_t;
+
+typedef enum {
+  ENCODER_UNCOMPRESSED,
+  ENCODER_RING,
+  ENCODER_DICTIONARY,
+} encoder_t;
+
+// Reference encoder: the ring of the last 16 label offsets written, each
+// compared label by label with the rest of the name
+
+typedef struct {
+  size_t offset[16];
+  size_t count;
+  size_t next;
+} ring_table_t;
+
+static size_t ring_table_find(const ring_table_t *table, const void *buffer,
+                              size_t capacity, const char *str,
+                              size_t first_length, size_t total_length) {
+  for (size_t istr = 0; istr < table->count; ++istr) {
+    if (table->offset[istr] >= capacity)
+      continue;
+    size_t offset = 0;
+    mdns_string_pair_t sub_string =
+        mdns_get_next_substring(buffer, capacity, table->offset[istr]);
+    if (!sub_string.length || (sub_string.length != first_length))
+      continue;
+    if (memcmp(str, MDNS_POINTER_OFFSET_CONST(buffer, sub_string.offset),
+               sub_string.length))
+      continue;
+
+    // Initial substring matches, now match all remaining substrings
+    offset += first_length + 1;
+    while (offset < total_length) {
+      size_t dot_pos = mdns_string_find(str, total_length, '.', offset);
+      if (dot_pos == MDNS_INVALID_POS)
+        dot_pos = total_length;
+      size_t current_length = dot_pos - offset;
+
+      sub_string = mdns_get_next_substring(
+          buffer, capacity, sub_string.offset + sub_string.length);
+      if (!sub_string.length || (sub_string.length != current_length))
+        break;
+      if (memcmp(str + offset,
+                 MDNS_POINTER_OFFSET_CONST(buffer, sub_string.offset),
+                 sub_string.length))
+        break;
+
+      offset = dot_pos + 1;
+    }
+
+    // Return reference offset if entire string matches
+    if (offset >= total_length)
+      return table->offset[istr];
+  }
+  return MDNS_INVALID_POS;
+}
+
+static void ring_table_add(ring_table_t *table, size_t offset) {
+  size_t table_capacity = sizeof(table->offset) / sizeof(table->offset[0]);
+  table->offset[table->next] = offset;
+  if (++table->count > table_capacity)
+    table->count = table_capacity;
+  if (++table->next >= table_capacity)
+    table->next = 0;
+}
+
+static void *ring_string_make(void *buffer, size_t capacity, void *data,
+                              const char *name, size_t length,
+                              ring_table_t *table) {
+  size_t last_pos = 0;
+  size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+  if (length && (name[length - 1] == '.'))
+    --length;
+  while (last_pos < length) {
+    size_t pos = mdns_string_find(name, length, '.', last_pos);
+    size_t sub_length = ((pos != MDNS_INVALID_POS) ? pos : length) - last_pos;
+    size_t total_length = length - last_pos;
+
+    size_t ref_offset = ring_table_find(table, buffer, capacity,
+                                        name + last_pos, sub_length,
+                                        total_length);
+    if (ref_offset != MDNS_INVALID_POS)
+      return mdns_string_make_ref(data, remain, ref_offset);
+
+    if (remain <= (sub_length + 1))
+      return 0;
+
+    *(unsigned char *)data = (unsigned char)sub_length;
+    memcpy(MDNS_POINTER_OFFSET(data, 1), name + last_pos, sub_length);
+    ring_table_add(table, MDNS_POINTER_DIFF(data, buffer));
+
+    data = MDNS_POINTER_OFFSET(data, sub_length + 1);
+    last_pos = ((pos != MDNS_INVALID_POS) ? pos + 1 : length);
+    remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+  }
+
+  if (!remain)
+    return 0;
+
+  *(unsigned char *)data = 0;
+  return MDNS_POINTER_OFFSET(data, 1);
+}
+
+// Same layout as mdns_record_write, with names through the ring
+static void *ring_record_write(void *buffer, size_t capacity, void *data,
+                               const mdns_record_t *record, uint16_t rclass,
+                               uint32_t ttl, ring_table_t *table) {
+  data = ring_string_make(buffer, capacity, data, record->name.str,
+                          record->name.length, table);
+  if (!data || (capacity - MDNS_POINTER_DIFF(data, buffer) < 10))
+    return 0;
+  data = mdns_htons(data, record->type);
+  data = mdns_htons(data, rclass);
+  data = mdns_htonl(data, ttl);
+  void *record_length = data;
+  data = mdns_htons(data, 0);
+  void *record_data = data;
+
+  size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+  if (record->rdata.length) {
+    if (remain < record->rdata.length)
+      return 0;
+    memcpy(data, record->rdata.str, record->rdata.length);
+    data = MDNS_POINTER_OFFSET(data, record->rdata.length);
+  } else {
+    switch (record->type) {
+    case MDNS_RECORDTYPE_PTR:
+      data = ring_string_make(buffer, capacity, data, record->data.ptr.name.str,
+                              record->data.ptr.name.length, table);
+      break;
+
+    case MDNS_RECORDTYPE_SRV:
+      if (remain <= 6)
+        return 0;
+      data = mdns_htons(data, record->data.srv.priority);
+      data = mdns_htons(data, record->data.srv.weight);
+      data = mdns_htons(data, record->data.srv.port);
+      data = ring_string_make(buffer, capacity, data, record->data.srv.name.str,
+                              record->data.srv.name.length, table);
+      break;
+
+    case MDNS_RECORDTYPE_NSEC:
+      data = ring_string_make(buffer, capacity, data,
+                              record->data.nsec.name.str,
+                              record->data.nsec.name.length, table);
+      if (!data || (capacity - MDNS_POINTER_DIFF(data, buffer) <
+                    record->data.nsec.bitmap.length))
+        return 0;
+      memcpy(data, record->data.nsec.bitmap.str,
+             record->data.nsec.bitmap.length);
+      data = MDNS_POINTER_OFFSET(data, record->data.nsec.bitmap.length);
+      break;
+
+    default: {
+      size_t length = mdns_record_rdata_encode(record, data, remain);
+      if (!length)
+        return 0;
+      data = MDNS_POINTER_OFFSET(data, length);
+      break;
+    }
+    }
+  }
+  if (!data)
+    return 0;
+
+  mdns_htons(record_length, (uint16_t)MDNS_POINTER_DIFF(data, record_data));
+  return data;
+}
+
+static int encode(const service_type_t *type, char *buffer, size_t capacity,
+                  encoder_t encoder, result_t *result) {
+  static mdns_string_table_t table;
+  static ring_table_t ring;
+  size_t total = type->answer_count + type->additional_count;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+    result->packets = 0;
+    result->bytes = 0;
+    size_t irec = 0;
+    while (irec < total) {
+      // A fresh dictionary for every packet, as the packet builder does
+      mdns_string_table_reset(&table);
+      memset(&ring, 0, sizeof(ring));
+      void *data = buffer + sizeof(struct mdns_header_t);
+      size_t first = irec;
+      for (; irec < total; irec++) {
+        const mdns_record_t *record =
+            (irec < type->answer_count)
+                ? type->answers[irec]
+                : type->additional[irec - type->answer_count];
+        uint16_t rclass = mdns_record_rclass(record, MDNS_CLASS_IN);
+        uint32_t ttl = mdns_record_multicast_ttl(record);
+        void *next;
+        if (encoder == ENCODER_RING)
+          next = ring_record_write(buffer, capacity, data, record, rclass, ttl,
+                                   &ring);
+        else
+          next = mdns_record_write(
+              buffer, capacity, data, record, rclass, ttl,
+              (encoder == ENCODER_DICTIONARY) ? &table : NULL);
+        if (!next)
+          break;
+        data = next;
+      }
+      if (irec == first)
+        return -1;
+      result->packets++;
+      result->bytes += MDNS_POINTER_DIFF(data, buffer);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result->us = ((double)(end.tv_sec - start.tv_sec) * 1e6 +
+                (double)(end.tv_nsec - start.tv_nsec) / 1e3) /
+               ITERATIONS;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int hosts = (argc > 1) ? atoi(argv[1]) : 100;
+  size_t capacity = (argc > 2) ? (size_t)atoi(argv[2]) : 1440;
+  if (hosts < 1 || capacity < 512) {
+    fprintf(stderr, "Usage: %s [hosts] [packet size >= 512]\n", argv[0]);
+    return 1;
+  }
+
+  service_t *services = calloc((size_t)hosts, sizeof(service_t));
+  char ip[32];
+  char host[32];
+  for (int ihost = 0; ihost < hosts; ihost++) {
+    snprintf(ip, sizeof(ip), "10.0.%d.%d", ihost / 256, ihost % 256);
+    snprintf(host, sizeof(host), "host%d", ihost);
+    services[ihost] = service_create(ip, host);
+  }
+  service_index_t index = {0};
+  if (service_index_build(&index, services, hosts) < 0) {
+    fprintf(stderr, "Unable to build the service index\n");
+    return 1;
+  }
+
+  char *buffer = malloc(capacity);
+  static const char *names[] = {"uncompressed:", "16-slot ring:",
+                                 "dictionary:"};
+  printf("%d hosts, %zu byte packets\n", hosts, capacity);
+  for (int encoder = ENCODER_UNCOMPRESSED; encoder <= ENCODER_DICTIONARY;
+       encoder++) {
+    result_t result;
+    if (encode(&index.types[0], buffer, capacity, (encoder_t)encoder,
+               &result) < 0) {
+      fprintf(stderr, "A record does not fit a %zu byte packet\n", capacity);
+      return 1;
+    }
+    printf("  %-14s %4zu packets, %6zu bytes, %7.1f us per answer\n",
+           names[encoder], result.packets, result.bytes, result.us);
+  }
+
+  free(buffer);
+  service_index_free(&index);
+  for (int ihost = 0; ihost < hosts; ihost++)
+    service_free(&services[ihost]);
+  free(services);
+  return 0;
+}
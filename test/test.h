@@ -0,0 +1,19 @@
+#pragma once
+#include <stdio.h>
+
+// Checks print where they failed and keep going, the test exits non-zero if
+// any of them did
+static int test_failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failures++;                                                         \
+    }                                                                          \
+  } while (0)
+
+static int test_result(const char *name) {
+  printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+  return test_failures ? 1 : 0;
+}
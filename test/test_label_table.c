@@ -0,0 +1,99 @@
+#include "../mdns.h"
+#include "test.h"
+
+// A header's worth of zeros, names start at offset 12
+#define NAMES 12
+
+static size_t packet(char *buffer, const char *names, size_t size) {
+  memset(buffer, 0, NAMES);
+  memcpy(buffer + NAMES, names, size);
+  return NAMES + size;
+}
+
+static int add(mdns_label_table_t *table, const char *buffer, size_t size,
+               size_t offset, size_t *end, uint16_t *label) {
+  *end = offset;
+  return mdns_label_table_add(table, buffer, size, end, label);
+}
+
+int main(void) {
+  static mdns_label_table_t table;
+  char buffer[128];
+  char str[64];
+  size_t end;
+  uint16_t label;
+  uint16_t other;
+
+  // Names sharing a suffix through a compression pointer share its labels
+  // \4plex\5local\0 at 12, \4HOST and a pointer to local at 23
+  size_t size = packet(buffer, "\4plex\5local\0\4HOST\xc0\x11", 19);
+  mdns_label_table_reset(&table);
+  CHECK(add(&table, buffer, size, NAMES, &end, &label));
+  CHECK(end == NAMES + 12);
+  mdns_string_t name =
+      mdns_label_table_extract(&table, buffer, label, str, sizeof(str));
+  CHECK((name.length == 11) && !memcmp(name.str, "plex.local.", 11));
+  CHECK(add(&table, buffer, size, NAMES + 12, &end, &other));
+  CHECK(end == size);
+  CHECK(table.count == 3);
+  CHECK(table.labels[other].next == table.labels[label].next);
+  name = mdns_label_table_extract(&table, buffer, other, str, sizeof(str));
+  CHECK((name.length == 11) && !memcmp(name.str, "HOST.local.", 11));
+  CHECK(mdns_label_table_equal(&table, buffer, other, "\4host\5LOCAL", 12));
+  CHECK(!mdns_label_table_equal(&table, buffer, other, "\4host\4locl", 11));
+  uint32_t hash = 0;
+  CHECK(mdns_string_hash(buffer, size, NAMES + 12, &hash));
+  CHECK(mdns_label_table_hash(&table, buffer, other) == hash);
+
+  // Decoding a name again reuses its labels and still finds its end
+  CHECK(add(&table, buffer, size, NAMES, &end, &other));
+  CHECK((other == label) && (end == NAMES + 12) && (table.count == 3));
+
+  // The root name has no labels
+  size = packet(buffer, "\0", 1);
+  mdns_label_table_reset(&table);
+  CHECK(add(&table, buffer, size, NAMES, &end, &label));
+  CHECK((label == MDNS_LABEL_NONE) && (end == NAMES + 1));
+
+  // A pointer to itself
+  size = packet(buffer, "\xc0\x0c", 2);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+
+  // Two pointers to each other
+  size = packet(buffer, "\xc0\x0e\xc0\x0c", 4);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+  CHECK(!add(&table, buffer, size, NAMES + 2, &end, &label));
+
+  // A pointer back to a label of the name being decoded
+  size = packet(buffer, "\3abc\3def\xc0\x0c", 10);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+
+  // A pointer past the end of the packet, and one cut short
+  size = packet(buffer, "\3abc\xc0\x7f", 6);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+  size = packet(buffer, "\3abc\xc0", 5);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+
+  // A label running past the end of the packet, a name without its root
+  // label, and a label longer than 63 bytes
+  size = packet(buffer, "\10abc", 4);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+  size = packet(buffer, "\3abc", 4);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+  size = packet(buffer, "\100abc\0", 5);
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, NAMES, &end, &label));
+
+  // A name starting past the end of the packet
+  mdns_label_table_reset(&table);
+  CHECK(!add(&table, buffer, size, size, &end, &label));
+
+  return test_result("label_table");
+}
@@ -0,0 +1,220 @@
+#include "../mdns.h"
+#include "../service.h"
+#include "../service_index.h"
+#include "test.h"
+
+#define HOSTS 100
+#define PACKETS_MAX 64
+
+// Every packet the builder sends, as queued for sending
+static char packets[PACKETS_MAX][1440];
+static size_t packet_sizes[PACKETS_MAX];
+static size_t packets_count = 0;
+
+static void on_packet_sent(const void *address, size_t address_size,
+                           const void *buffer, size_t size) {
+  CHECK(packets_count < PACKETS_MAX);
+  CHECK(size <= sizeof(packets[0]));
+  if ((packets_count == PACKETS_MAX) || (size > sizeof(packets[0])))
+    return;
+  memcpy(packets[packets_count], buffer, size);
+  packet_sizes[packets_count++] = size;
+}
+
+static bool name_equal(mdns_string_t decoded, mdns_string_t expected) {
+  if (expected.length && (expected.str[expected.length - 1] == '.'))
+    expected.length--;
+  if (decoded.length && (decoded.str[decoded.length - 1] == '.'))
+    decoded.length--;
+  return (decoded.length == expected.length) &&
+         !memcmp(decoded.str, expected.str, expected.length);
+}
+
+// Decode the name at offset and check it is the expected name. Its
+// compression pointer, if any, must point before the name, at a label of a
+// name decoded earlier in the packet, never at bytes of a record that was
+// abandoned.
+static bool name_check(mdns_label_table_t *table, const char *buffer,
+                       size_t size, size_t *offset, mdns_string_t expected) {
+  for (size_t cur = *offset; cur < size;) {
+    uint8_t length = (uint8_t)buffer[cur];
+    if (mdns_is_string_ref(length)) {
+      if (cur + 2 > size)
+        return false;
+      size_t target =
+          mdns_ntohs(MDNS_POINTER_OFFSET_CONST(buffer, cur)) & 0x3fff;
+      size_t slot = mdns_label_table_slot(table, target);
+      CHECK(target < *offset);
+      CHECK(table->slot_offset[slot] == target);
+      if ((target >= *offset) || (table->slot_offset[slot] != target))
+        return false;
+      break;
+    }
+    if (!length)
+      break;
+    cur += 1 + (size_t)length;
+  }
+
+  uint16_t label;
+  if (!mdns_label_table_add(table, buffer, size, offset, &label))
+    return false;
+  char str[256];
+  mdns_string_t name =
+      mdns_label_table_extract(table, buffer, label, str, sizeof(str));
+  CHECK(name_equal(name, expected));
+  return name_equal(name, expected);
+}
+
+// Decode one record, which must be the given one
+static bool record_check(mdns_label_table_t *table, const char *buffer,
+                         size_t size, size_t *offset,
+                         const mdns_record_t *record) {
+  if (!name_check(table, buffer, size, offset, record->name))
+    return false;
+  if (*offset + 10 > size)
+    return false;
+  const void *header = MDNS_POINTER_OFFSET_CONST(buffer, *offset);
+  uint16_t rtype = mdns_ntohs(header);
+  size_t rdata_length = mdns_ntohs(MDNS_POINTER_OFFSET_CONST(header, 8));
+  CHECK(rtype == record->type);
+  size_t rdata = *offset + 10;
+  size_t end = rdata + rdata_length;
+  if ((rtype != record->type) || (end > size))
+    return false;
+
+  // Names in RDATA end with the RDATA
+  size_t name_offset = rdata;
+  mdns_string_t name = {0};
+  if (record->type == MDNS_RECORDTYPE_PTR) {
+    name = record->data.ptr.name;
+  } else if (record->type == MDNS_RECORDTYPE_SRV) {
+    name = record->data.srv.name;
+    name_offset += 6;
+  } else if (record->type == MDNS_RECORDTYPE_NSEC) {
+    name = record->data.nsec.name;
+  }
+  if (name.str && !record->rdata.length) {
+    if (!name_check(table, buffer, end, &name_offset, name))
+      return false;
+    if (record->type == MDNS_RECORDTYPE_NSEC)
+      name_offset += record->data.nsec.bitmap.length;
+    CHECK(name_offset == end);
+  }
+  *offset = end;
+  return true;
+}
+
+// Decode every packet sent, which must hold the records in the order they
+// were added, each of them once, answers first
+static void packets_check(const mdns_record_t *const *answers,
+                          size_t answer_count,
+                          const mdns_record_t *const *additional,
+                          size_t additional_count, size_t capacity) {
+  static mdns_label_table_t table;
+  size_t total = answer_count + additional_count;
+  size_t irec = 0;
+  for (size_t ipacket = 0; ipacket < packets_count; ipacket++) {
+    const char *buffer = packets[ipacket];
+    size_t size = packet_sizes[ipacket];
+    CHECK(size <= capacity);
+    struct mdns_header_t header;
+    CHECK(uvmdns_header_parse(buffer, size, &header));
+    CHECK(!header.questions && !header.authority_rrs);
+    size_t count = (size_t)header.answer_rrs + header.additional_rrs;
+    CHECK(count > 0);
+
+    mdns_label_table_reset(&table);
+    size_t offset = sizeof(struct mdns_header_t);
+    for (size_t i = 0; i < count; i++, irec++) {
+      CHECK(irec < total);
+      if (irec >= total)
+        return;
+      // Counts in the header put each record in the section it was added to
+      CHECK((i < header.answer_rrs) == (irec < answer_count));
+      const mdns_record_t *record = (irec < answer_count)
+                                        ? answers[irec]
+                                        : additional[irec - answer_count];
+      if (!record_check(&table, buffer, size, &offset, record)) {
+        fprintf(stderr, "packet %zu record %zu did not decode\n", ipacket, i);
+        test_failures++;
+        return;
+      }
+    }
+    CHECK(offset == size);
+  }
+  CHECK(irec == total);
+}
+
+int main(void) {
+  static service_t services[HOSTS];
+  char ip[32];
+  char host[32];
+  for (int ihost = 0; ihost < HOSTS; ihost++) {
+    snprintf(ip, sizeof(ip), "10.0.%d.%d", ihost / 256, ihost % 256);
+    snprintf(host, sizeof(host), "host%d", ihost);
+    services[ihost] = service_create(ip, host);
+  }
+  service_index_t index = {0};
+  CHECK(service_index_build(&index, services, HOSTS) == 0);
+  const service_type_t *type = &index.types[0];
+  CHECK(type->answer_count == HOSTS);
+
+  // Sent unicast to a socket of our own, which never reads them
+  uv_loop_t *loop = uv_default_loop();
+  uv_udp_t receiver;
+  uv_udp_t sender;
+  struct sockaddr_in address;
+  int addrlen = sizeof(address);
+  uv_ip4_addr("127.0.0.1", 0, &address);
+  CHECK(uv_udp_init(loop, &receiver) == 0);
+  CHECK(uv_udp_bind(&receiver, (const struct sockaddr *)&address, 0) == 0);
+  CHECK(uv_udp_getsockname(&receiver, (struct sockaddr *)&address,
+                           &addrlen) == 0);
+  CHECK(uv_udp_init(loop, &sender) == 0);
+  mdns_send_observer = on_packet_sent;
+
+  static const size_t capacities[] = {512, 1440};
+  char buffer[1440];
+  for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+    size_t capacity = capacities[i];
+    packets_count = 0;
+    CHECK(mdns_answer_records(&sender, &address, sizeof(address), buffer,
+                              capacity, 0, NULL, 0, type->answers,
+                              type->answer_count, type->additional,
+                              type->additional_count) == 0);
+    CHECK(packets_count > 1);
+    packets_check(type->answers, type->answer_count, type->additional,
+                  type->additional_count, capacity);
+    uv_run(loop, UV_RUN_NOWAIT);
+
+    // Without a handle the builder writes the first of those packets only,
+    // ending it at the first record that does not fit
+    mdns_packet_builder_t builder;
+    mdns_packet_builder_init(&builder, NULL, &address, sizeof(address),
+                             buffer, capacity, 0, NULL, 0);
+    size_t irec = 0;
+    while ((irec < type->answer_count) &&
+           (mdns_packet_builder_add(&builder, type->answers[irec],
+                                    MDNS_ENTRYTYPE_ANSWER) == 0))
+      irec++;
+    for (size_t iadd = 0; (irec == type->answer_count) &&
+                          (iadd < type->additional_count);
+         iadd++) {
+      if (mdns_packet_builder_add(&builder, type->additional[iadd],
+                                  MDNS_ENTRYTYPE_ADDITIONAL) < 0)
+        break;
+    }
+    size_t size = mdns_packet_builder_close(&builder);
+    CHECK((size == packet_sizes[0]) && !memcmp(buffer, packets[0], size));
+  }
+
+  mdns_send_observer = NULL;
+  uv_close((uv_handle_t *)&sender, NULL);
+  uv_close((uv_handle_t *)&receiver, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+  uv_loop_close(loop);
+  service_index_free(&index);
+  for (int ihost = 0; ihost < HOSTS; ihost++)
+    service_free(&services[ihost]);
+  return test_result("packet_builder");
+}
@@ -0,0 +1,99 @@
+#include "../packet_cache.h"
+#include "test.h"
+
+// A query for plex.local A with the given ID
+static size_t query(char *buffer, uint16_t id) {
+  static const char question[] = "\4plex\5local\0\0\1\0\1";
+  memset(buffer, 0, 12);
+  buffer[0] = (char)(id >> 8);
+  buffer[1] = (char)id;
+  buffer[5] = 1;
+  memcpy(buffer + 12, question, sizeof(question) - 1);
+  return 12 + sizeof(question) - 1;
+}
+
+// Its answer, with the given TTL
+static size_t answer(char *buffer, uint32_t ttl) {
+  static const char record[] = "\4plex\5local\0\0\1\0\1";
+  memset(buffer, 0, 12);
+  buffer[2] = (char)0x84;
+  buffer[7] = 1;
+  size_t size = 12;
+  memcpy(buffer + size, record, sizeof(record) - 1);
+  size += sizeof(record) - 1;
+  mdns_htonl(buffer + size, ttl);
+  size += 4;
+  memcpy(buffer + size, "\0\4\300\250\1\12", 6);
+  return size + 6;
+}
+
+static void answer_query(packet_cache_t *cache, const char *data,
+                         size_t size, uint64_t now, uint32_t ttl) {
+  char response[64];
+  packet_cache_begin(cache, data, size, now);
+  packet_cache_record(cache, false, response, answer(response, ttl));
+  packet_cache_commit(cache, now);
+}
+
+int main(void) {
+  static packet_cache_t cache;
+  char data[64];
+  char response[64];
+  size_t size = query(data, 0);
+  size_t response_size = answer(response, 1);
+
+  // A repeat of a query answered before is a hit, with the same answers,
+  // even past the TTL of the records in them
+  CHECK(!packet_cache_find(&cache, data, size, 1000));
+  answer_query(&cache, data, size, 1000, 1);
+  const packet_cache_entry_t *entry =
+      packet_cache_find(&cache, data, size, 2500);
+  CHECK(entry && (entry->responses_count == 1));
+  CHECK(entry && !entry->responses[0]->unicast &&
+        (entry->responses[0]->size == response_size) &&
+        !memcmp(entry->responses[0]->data, response, response_size));
+  CHECK(cache.hits == 1);
+
+  // Answering it again replaces the entry instead of adding another
+  answer_query(&cache, data, size, 3000, 1);
+  size_t used = 0;
+  for (int i = 0; i < PACKET_CACHE_ENTRIES; i++)
+    used += cache.entries[i].size ? 1 : 0;
+  CHECK(used == 1);
+
+  // Entries expire after their lifetime
+  CHECK(packet_cache_find(&cache, data, size, 3000 + PACKET_CACHE_LIFETIME -
+                                                  1));
+  CHECK(!packet_cache_find(&cache, data, size, 3000 + PACKET_CACHE_LIFETIME));
+
+  // Fill the cache, then begin a query that is not committed: nothing is
+  // evicted for it
+  for (uint16_t id = 1; id <= PACKET_CACHE_ENTRIES; id++)
+    answer_query(&cache, data, query(data, id), 10000 + id, 1);
+  size = query(data, 1000);
+  packet_cache_begin(&cache, data, size, 15000);
+  packet_cache_record(&cache, false, response, response_size);
+  packet_cache_cancel(&cache);
+  packet_cache_commit(&cache, 15000);
+  CHECK(!packet_cache_find(&cache, data, size, 15000));
+  for (uint16_t id = 1; id <= PACKET_CACHE_ENTRIES; id++)
+    CHECK(packet_cache_find(&cache, data, query(data, id), 15000));
+
+  // Neither is anything evicted for answers with a TTL of 0
+  size = query(data, 1001);
+  answer_query(&cache, data, size, 15000, 0);
+  CHECK(!packet_cache_find(&cache, data, size, 15000));
+  for (uint16_t id = 1; id <= PACKET_CACHE_ENTRIES; id++)
+    CHECK(packet_cache_find(&cache, data, query(data, id), 15000));
+
+  // A committed query takes the place of the one used least recently
+  CHECK(packet_cache_find(&cache, data, query(data, 1), 15001));
+  size = query(data, 1002);
+  answer_query(&cache, data, size, 15002, 1);
+  CHECK(packet_cache_find(&cache, data, size, 15002));
+  CHECK(packet_cache_find(&cache, data, query(data, 1), 15002));
+  CHECK(!packet_cache_find(&cache, data, query(data, 2), 15002));
+
+  packet_cache_clear(&cache);
+  return test_result("packet_cache");
+}
@@ -0,0 +1,47 @@
+#include "../rate_limit.h"
+#include "test.h"
+
+int main(void) {
+  rate_limit_t limit;
+  CHECK(rate_limit_init(&limit, 3) == 0);
+
+  // The first multicast of a record is always allowed, a repeat only once
+  // the interval has passed since
+  CHECK(rate_limit_allow(&limit, 0, 1000, RATE_LIMIT_INTERVAL));
+  CHECK(!rate_limit_allow(&limit, 0, 1500, RATE_LIMIT_INTERVAL));
+  CHECK(!rate_limit_allow(&limit, 0, 1999, RATE_LIMIT_INTERVAL));
+  CHECK(rate_limit_allow(&limit, 0, 2000, RATE_LIMIT_INTERVAL));
+  CHECK(limit.allowed == 2);
+  CHECK(limit.dropped == 2);
+
+  // A dropped multicast does not restart the window
+  CHECK(!rate_limit_allow(&limit, 0, 2900, RATE_LIMIT_INTERVAL));
+  CHECK(rate_limit_allow(&limit, 0, 3000, RATE_LIMIT_INTERVAL));
+
+  // Defending against a probe only needs a quarter of a second
+  CHECK(!rate_limit_allow(&limit, 0, 3200, RATE_LIMIT_INTERVAL_PROBE));
+  CHECK(rate_limit_allow(&limit, 0, 3250, RATE_LIMIT_INTERVAL_PROBE));
+
+  // Checking a record does not stamp it
+  CHECK(!rate_limit_ready(&limit, 0, 3400, RATE_LIMIT_INTERVAL_PROBE));
+  CHECK(rate_limit_ready(&limit, 0, 3500, RATE_LIMIT_INTERVAL_PROBE));
+  CHECK(rate_limit_ready(&limit, 0, 3500, RATE_LIMIT_INTERVAL_PROBE));
+  CHECK(rate_limit_ready(&limit, 1, 3500, RATE_LIMIT_INTERVAL));
+
+  // Records are limited independently
+  CHECK(rate_limit_allow(&limit, 1, 3250, RATE_LIMIT_INTERVAL));
+  CHECK(rate_limit_allow(&limit, 2, 3250, RATE_LIMIT_INTERVAL));
+
+  // An announcement counts as a multicast for the window
+  rate_limit_stamp(&limit, 2, 5000);
+  CHECK(!rate_limit_allow(&limit, 2, 5500, RATE_LIMIT_INTERVAL));
+  CHECK(rate_limit_allow(&limit, 2, 6000, RATE_LIMIT_INTERVAL));
+
+  // Records without a slot are never limited
+  CHECK(rate_limit_allow(&limit, 3, 6000, RATE_LIMIT_INTERVAL));
+  CHECK(rate_limit_allow(&limit, 3, 6000, RATE_LIMIT_INTERVAL));
+  rate_limit_stamp(&limit, 100, 6000);
+
+  rate_limit_free(&limit);
+  return test_result("rate_limit");
+}
@@ -0,0 +1,48 @@
+#include "../recv_pool.h"
+#include "test.h"
+
+int main(void) {
+  recv_pool_t pool;
+  CHECK(recv_pool_init(&pool, 2, 64) == 0);
+
+  char *a = recv_pool_get(&pool);
+  char *b = recv_pool_get(&pool);
+  CHECK(a && b && (a != b));
+  CHECK(pool.free_count == 0);
+  CHECK(pool.exhausted == 0);
+
+  // With every buffer in use a read still gets one, allocated for it
+  char *c = recv_pool_get(&pool);
+  CHECK(c && (c != a) && (c != b));
+  CHECK(pool.exhausted == 1);
+  CHECK(pool.in_use == 3);
+  CHECK(pool.high_water == 3);
+
+  // A pointer into a buffer, like a recvmmsg chunk, is not a buffer
+  CHECK(recv_pool_put(&pool, a + 8) < 0);
+  CHECK(pool.free_count == 0);
+  CHECK(pool.in_use == 3);
+
+  // A buffer is given back once, a second time is refused
+  CHECK(recv_pool_put(&pool, a) == 0);
+  CHECK(recv_pool_put(&pool, a) < 0);
+  CHECK(pool.free_count == 1);
+  CHECK(recv_pool_put(&pool, b) == 0);
+  CHECK(recv_pool_put(&pool, b) < 0);
+  CHECK(pool.free_count == 2);
+  CHECK(recv_pool_put(&pool, c) == 0);
+  CHECK(recv_pool_put(&pool, NULL) == 0);
+  CHECK(pool.in_use == 0);
+  CHECK(pool.free_count <= pool.count);
+
+  // Buffers given back are handed out again, nothing more is allocated
+  char *d = recv_pool_get(&pool);
+  char *e = recv_pool_get(&pool);
+  CHECK(((d == a) && (e == b)) || ((d == b) && (e == a)));
+  CHECK(pool.exhausted == 1);
+  CHECK(recv_pool_put(&pool, d) == 0);
+  CHECK(recv_pool_put(&pool, e) == 0);
+
+  recv_pool_free(&pool);
+  return test_result("recv_pool");
+}